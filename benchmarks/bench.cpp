@@ -0,0 +1,375 @@
+// Micro-benchmarks of the tokenizer, sampler, ring buffer, eval and matmuls.
+//
+//   gptj-bench [-m model.bin] [-t n_threads] [-b n_batch] [--min-time s]
+//
+// Each result is printed as one JSON object per line. The eval benchmarks use
+// a small model with random weights unless a model file is given. They run
+// with all the layers loaded and again with lazily loaded layers, which are
+// paged in while evaluating from an indexed copy of the model file, both with
+// the file in the page cache and with it dropped before each run. The
+// tokenizer benchmarks are labeled with the vocab they use, since the vocab of
+// the small model is not the GPT-J one.
+//
+// It is linked with the objects of the library to benchmark its internal
+// functions.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "ggml/ggml.h"
+#include "gptj-file.h"
+#include "gptj-internal.h"
+#include "tiny-model.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+double g_min_time_s = 0.5;
+
+// Runs fn once to warm up and then repeatedly for at least g_min_time_s
+// seconds, and prints the time per run. n_items is the number of items (such
+// as tokens) processed per run. setup, if given, runs before each run and is
+// not timed.
+void Bench(const std::string &name, const std::string &args,
+           const int64_t n_items, const std::function<void()> &fn,
+           const std::function<void()> &setup = nullptr) {
+  using clock = std::chrono::steady_clock;
+  if (setup) {
+    setup();
+  }
+  fn();
+
+  std::vector<double> times_ns;
+  const auto t_start = clock::now();
+  do {
+    if (setup) {
+      setup();
+    }
+    const auto t_run = clock::now();
+    fn();
+    times_ns.push_back(
+        std::chrono::duration<double, std::nano>(clock::now() - t_run).count());
+  } while (times_ns.size() < 3 ||
+           std::chrono::duration<double>(clock::now() - t_start).count() <
+               g_min_time_s);
+
+  std::sort(times_ns.begin(), times_ns.end());
+  double total_ns = 0;
+  for (const double t : times_ns) {
+    total_ns += t;
+  }
+  const double mean_ns = total_ns / times_ns.size();
+  printf(
+      "{\"name\": \"%s\", \"args\": \"%s\", \"runs\": %zu, \"mean_ns\": %.0f, "
+      "\"median_ns\": %.0f, \"min_ns\": %.0f, \"items_per_s\": %.2f}\n",
+      name.c_str(), args.c_str(), times_ns.size(), mean_ns,
+      times_ns[times_ns.size() / 2], times_ns[0], n_items * 1e9 / mean_ns);
+  fflush(stdout);
+}
+
+std::string Repeat(const std::string &text, const int n) {
+  std::string result;
+  for (int i = 0; i < n; i++) {
+    result += text;
+  }
+  return result;
+}
+
+// vocab_name is "tiny" for the vocab of the small model, which only has the
+// bytes and a few words, or "model" for the vocab of the model file.
+void BenchTokenizer(const gpt_vocab &vocab, const std::string &vocab_name) {
+  const std::string sentence =
+      "The quick brown fox jumps over the lazy dog, and it was not the first "
+      "time that he did this in the morning.\n";
+  const std::string unicode =
+      "Größenverhältnisse — 日本語のテキスト, 한국어 문장, Ελληνικά, "
+      "emoji 🙂🚀 and ünïcödé.\n";
+  const std::vector<std::pair<std::string, std::string>> inputs = {
+      {"short", "Hello world"},
+      {"long", Repeat(sentence, 32)},
+      {"unicode", Repeat(unicode, 16)},
+  };
+  for (const auto &[name, text] : inputs) {
+    const int n_tokens = gpt_tokenize(vocab, text).size();
+    Bench("gpt_tokenize",
+          name + " bytes=" + std::to_string(text.size()) + " vocab=" +
+              vocab_name + " n_vocab=" + std::to_string(vocab.size()),
+          n_tokens, [&]() { gpt_tokenize(vocab, text); });
+  }
+}
+
+// Uses the GPT-J vocab size since the sampler cost depends on it.
+void BenchSampler() {
+  const int n_vocab = 50400;
+  gpt_vocab vocab;
+  for (int i = 0; i < n_vocab; i++) {
+    vocab.add("");
+  }
+  vocab.build_table();
+
+  std::mt19937 rng(1234);
+  std::normal_distribution<float> dist(0.0f, 3.0f);
+  std::vector<float> logits(n_vocab);
+  for (float &logit : logits) {
+    logit = dist(rng);
+  }
+
+  std::unordered_set<gpt_vocab::id> recent_tokens;
+  for (int i = 0; i < 64; i++) {
+    recent_tokens.insert(rng() % n_vocab);
+  }
+  const std::unordered_set<gpt_vocab::id> no_tokens;
+
+  struct setting {
+    int top_k;
+    float top_p;
+    float repeat_penalty;
+  };
+  for (const setting &s : std::vector<setting>{{40, 0.9f, 1.0f},
+                                               {40, 0.9f, 1.1f},
+                                               {1, 1.0f, 1.0f},
+                                               {n_vocab, 1.0f, 1.0f},
+                                               {n_vocab, 0.5f, 1.1f}}) {
+    const auto &recent = s.repeat_penalty == 1.0f ? no_tokens : recent_tokens;
+    char args[128];
+    snprintf(args, sizeof(args), "n_vocab=%d top_k=%d top_p=%.2f penalty=%.2f",
+             n_vocab, s.top_k, s.top_p, s.repeat_penalty);
+    Bench("gpt_sample_top_k_top_p", args, 1, [&]() {
+      gpt_sample_top_k_top_p(vocab, logits.data(), s.top_k, s.top_p, 0.9,
+                             s.repeat_penalty, recent, rng);
+    });
+  }
+}
+
+void BenchRingBuffer() {
+  const int capacity = 2048;
+  GptjRingBuffer buffer;
+  buffer.Init(capacity);
+  for (int i = 0; i < capacity + capacity / 3; i++) {
+    buffer.Add(i % 50400);
+  }
+  for (const int n : {64, 256, capacity}) {
+    Bench("GptjRingBuffer::GetRecent",
+          "capacity=" + std::to_string(capacity) + " n=" + std::to_string(n),
+          n, [&]() { buffer.GetRecent(n); });
+  }
+}
+
+// Drops the pages of a file from the page cache, so that they are read from
+// the disk again.
+void DropPageCache(const int fd) {
+#ifndef _WIN32
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+// Benchmarks the eval. With lazily loaded layers, it runs with the model file
+// in the page cache (cache=warm), which is the cost of splitting the graph by
+// layer, and with the file dropped from the page cache before each run
+// (cache=cold), which is the cost of paging the layers in from the disk.
+// model_fd is the model file, which is needed for cache=cold.
+void BenchEval(const gptj_model &model, const int n_threads, const int n_batch,
+               const int model_fd = -1) {
+  const bool lazy = model.pager != nullptr;
+  const int n_ctx = model.hparams.n_ctx;
+  std::vector<float> logits;
+  size_t mem_per_token = 0;
+
+  // estimate the memory per token
+  gptj_eval(model, n_threads, 0, {0, 1, 2, 3}, logits, mem_per_token);
+
+  std::vector<std::string> caches = {""};
+  if (lazy) {
+    caches = {" cache=warm"};
+    if (model_fd >= 0) {
+      caches.push_back(" cache=cold");
+    }
+  }
+  for (const std::string &cache : caches) {
+    const bool cold = cache == " cache=cold";
+    for (const int N : {1, n_batch}) {
+      for (const int n_past : {0, n_ctx / 4, n_ctx - N}) {
+        const std::vector<gpt_vocab::id> tokens(N, 42);
+        char args[160];
+        snprintf(args, sizeof(args),
+                 "n_layer=%d n_embd=%d N=%d n_past=%d n_threads=%d lazy=%d%s",
+                 model.hparams.n_layer, model.hparams.n_embd, N, n_past,
+                 n_threads, lazy, cache.c_str());
+        Bench(
+            "gptj_eval", args, N,
+            [&]() {
+              gptj_eval(model, n_threads, n_past, tokens, logits,
+                        mem_per_token);
+            },
+            [&]() {
+              if (cold) {
+                DropPageCache(model_fd);
+              }
+            });
+      }
+    }
+  }
+}
+
+// Multiplies a weight matrix of each type by N vectors, as in the linear
+// layers of the model. Items are FLOPs. Compare builds with different
+// GPTJ_INSTRUCTIONS to see whether the flags of an instruction set make
+// ggml faster.
+void BenchMatMul(const int n_threads, const int n_batch) {
+  const int k = 4096;
+  const int m = 4096;
+  std::mt19937 rng(1234);
+  std::normal_distribution<float> dist(0.0f, 1.0f);
+  std::vector<float> data((size_t)k * m);
+  for (float &x : data) {
+    x = dist(rng);
+  }
+  std::vector<int64_t> hist(1 << 4);
+
+  for (const ggml_type type : {GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q4_1,
+                               GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_Q8_0}) {
+    for (const int N : {1, n_batch}) {
+      struct ggml_init_params params = {
+          .mem_size = data.size() * sizeof(float) + (size_t)k * N * 16 +
+                      (size_t)m * N * 4 + 1024 * 1024,
+          .mem_buffer = NULL,
+          .no_alloc = false,
+      };
+      struct ggml_context *ctx = ggml_init(params);
+
+      struct ggml_tensor *w = ggml_new_tensor_2d(ctx, type, k, m);
+      if (type == GGML_TYPE_F16) {
+        for (size_t i = 0; i < data.size(); i++) {
+          ((ggml_fp16_t *)w->data)[i] = ggml_fp32_to_fp16(data[i]);
+        }
+      } else {
+        ggml_quantize_chunk(type, data.data(), w->data, 0, data.size(),
+                            hist.data());
+      }
+      struct ggml_tensor *x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, N);
+      memcpy(x->data, data.data(), ggml_nbytes(x));
+
+      struct ggml_cgraph gf = {.n_threads = n_threads};
+      ggml_build_forward_expand(&gf, ggml_mul_mat(ctx, w, x));
+
+      char args[128];
+      snprintf(args, sizeof(args),
+               "type=%s m=%d k=%d N=%d n_threads=%d instructions=%s",
+               ggml_type_name(type), m, k, N, n_threads,
+               gptj_build_instructions());
+      Bench("ggml_mul_mat", args, 2ll * m * k * N,
+            [&]() { ggml_graph_compute(ctx, &gf); });
+
+      ggml_free(ctx);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string model_path;
+  int n_threads = std::min(4, (int)std::thread::hardware_concurrency());
+  int n_batch = 32;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "-m") {
+      model_path = argv[i + 1];
+    } else if (arg == "-t") {
+      n_threads = std::atoi(argv[i + 1]);
+    } else if (arg == "-b") {
+      n_batch = std::atoi(argv[i + 1]);
+    } else if (arg == "--min-time") {
+      g_min_time_s = std::atof(argv[i + 1]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [-m model.bin] [-t n_threads] [-b n_batch] "
+              "[--min-time s]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  std::string random_model_path;
+  if (model_path.empty()) {
+    random_model_path =
+        (std::filesystem::temp_directory_path() / "gptj-bench-model.bin")
+            .string();
+    if (!gptj_write_tiny_model(random_model_path, gptj_tiny_model_params())) {
+      return 1;
+    }
+    model_path = random_model_path;
+  }
+
+  // lazily loaded layers need the indexed format
+  const std::string lazy_model_path =
+      (std::filesystem::temp_directory_path() / "gptj-bench-model-indexed.bin")
+          .string();
+  bool converted = false;
+  {
+    std::ifstream fin(model_path, std::ios::binary);
+    std::ofstream fout(lazy_model_path, std::ios::binary);
+    gptj_file_model file_model;
+    converted = file_model.Read(fin) &&
+                file_model.WriteIndexed(fin, fout, GPTJ_FILE_ALIGNMENT);
+  }
+  int lazy_model_fd = -1;
+#ifndef _WIN32
+  lazy_model_fd = open(lazy_model_path.c_str(), O_RDONLY);
+  // dirty pages can't be dropped from the page cache
+  if (lazy_model_fd >= 0) {
+    fsync(lazy_model_fd);
+  }
+#endif
+
+  gptj_model model;
+  gptj_model lazy_model;
+  gpt_vocab vocab;
+  gpt_vocab lazy_vocab;
+  gptj_load_params lazy_params;
+  lazy_params.lazy_layers = true;
+  const bool loaded =
+      converted && gptj_model_load(model_path, model, vocab) &&
+      gptj_model_load(lazy_model_path, lazy_model, lazy_vocab, lazy_params);
+  if (!random_model_path.empty()) {
+    std::filesystem::remove(random_model_path);
+  }
+  std::filesystem::remove(lazy_model_path);
+  if (!loaded) {
+    fprintf(stderr, "%s: failed to load model '%s'\n", __func__,
+            model_path.c_str());
+    return 1;
+  }
+
+  BenchTokenizer(vocab, random_model_path.empty() ? "model" : "tiny");
+  BenchSampler();
+  BenchRingBuffer();
+  BenchEval(model, n_threads, n_batch);
+  BenchEval(lazy_model, n_threads, n_batch, lazy_model_fd);
+  BenchMatMul(n_threads, n_batch);
+
+  gptj_model_free(model);
+  gptj_model_free(lazy_model);
+#ifndef _WIN32
+  if (lazy_model_fd >= 0) {
+    close(lazy_model_fd);
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,83 @@
+// Converts a model from the ggml format to the indexed format, which has a
+// directory of the tensors, a prebuilt vocab and aligned tensor data. Models
+// in an older version of the indexed format are converted to the current
+// version. See gptj-file.h.
+//
+//   gptj-convert -i model.bin -o model-indexed.bin [--align n]
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "ggml/ggml.h"
+#include "gptj-file.h"
+
+namespace {
+
+bool Convert(const std::string &fname_inp, const std::string &fname_out,
+             const uint32_t alignment) {
+  std::ifstream fin(fname_inp, std::ios::binary);
+  if (!fin) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname_inp.c_str());
+    return false;
+  }
+
+  gptj_file_model model;
+  if (!model.Read(fin)) {
+    fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname_inp.c_str());
+    return false;
+  }
+  if (model.indexed && model.version == GPTJ_FILE_VERSION) {
+    fprintf(stderr, "%s: '%s' is already in the indexed format\n", __func__,
+            fname_inp.c_str());
+    return false;
+  }
+
+  std::ofstream fout(fname_out, std::ios::binary);
+  if (!fout) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname_out.c_str());
+    return false;
+  }
+
+  if (!model.WriteIndexed(fin, fout, alignment)) {
+    fprintf(stderr, "%s: failed to convert '%s' to '%s'\n", __func__,
+            fname_inp.c_str(), fname_out.c_str());
+    return false;
+  }
+  const int n_tensors = model.tensors.size();
+  fprintf(stderr, "%s: wrote %d tensors to '%s'\n", __func__, n_tensors,
+          fname_out.c_str());
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string fname_inp;
+  std::string fname_out;
+  uint32_t alignment = GPTJ_FILE_ALIGNMENT;
+
+  bool valid = argc % 2 == 1;
+  for (int i = 1; valid && i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "-i") {
+      fname_inp = argv[i + 1];
+    } else if (arg == "-o") {
+      fname_out = argv[i + 1];
+    } else if (arg == "--align") {
+      alignment = std::strtoul(argv[i + 1], nullptr, 10);
+    } else {
+      valid = false;
+    }
+  }
+  // the alignment must be a power of 2
+  if (!valid || fname_inp.empty() || fname_out.empty() || alignment == 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    fprintf(stderr, "usage: %s -i model.bin -o model-indexed.bin [--align n]\n",
+            argv[0]);
+    return 1;
+  }
+
+  return Convert(fname_inp, fname_out, alignment) ? 0 : 1;
+}
@@ -0,0 +1,260 @@
+// The gptj library, which loads the build of the library for the fastest
+// instructions that the CPU supports and forwards each call to it. The builds
+// are next to this library as gptj-<instructions>, such as libgptj-avx2.so,
+// and each one has ggml built for its instructions. GPTJ_INSTRUCTIONS in the
+// environment names the build to load instead, such as "avx".
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include "gptj-cpu.h"
+#include "gptj.h"
+
+namespace {
+
+class GptjLibrary {
+ public:
+  GptjLibrary() {
+    const std::string dir = Directory();
+    const char *name = std::getenv("GPTJ_INSTRUCTIONS");
+    if (name != nullptr && name[0] != '\0') {
+      const int index = gptj_instructions_index(name);
+      if (index < 0) {
+        fprintf(stderr, "%s: unknown instructions '%s' in GPTJ_INSTRUCTIONS\n",
+                __func__, name);
+      } else if (!Open(dir, index)) {
+        fprintf(stderr, "%s: failed to load the %s build of the library\n",
+                __func__, name);
+      }
+      return;
+    }
+
+    // CPUs other than x86 only have the basic build
+    for (int i = std::max(0, gptj_cpu_instructions_index()); i >= 0; i--) {
+      if (Open(dir, i)) {
+        return;
+      }
+    }
+    fprintf(stderr, "%s: failed to load a build of the library from '%s'\n",
+            __func__, dir.c_str());
+  }
+
+  bool Loaded() const { return handle_ != nullptr; }
+
+  // Returns a function of the loaded build. The builds are made from the same
+  // source as this library, so they have all of its functions.
+  void *Symbol(const char *name) const {
+#ifdef _WIN32
+    void *symbol = (void *)GetProcAddress((HMODULE)handle_, name);
+#else
+    void *symbol = dlsym(handle_, name);
+#endif
+    if (symbol == nullptr) {
+      fprintf(stderr, "%s: the %s build of the library has no %s\n", __func__,
+              gptj_instructions[index_], name);
+      std::abort();
+    }
+    return symbol;
+  }
+
+ private:
+  // Returns the directory of this library with a trailing separator.
+  static std::string Directory() {
+    std::string path;
+#ifdef _WIN32
+    HMODULE module = nullptr;
+    char buf[MAX_PATH] = {};
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                               GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                           (LPCSTR)&Directory, &module) &&
+        GetModuleFileNameA(module, buf, sizeof(buf)) > 0) {
+      path = buf;
+    }
+#else
+    Dl_info info = {};
+    if (dladdr((void *)&Directory, &info) != 0 && info.dli_fname != nullptr) {
+      path = info.dli_fname;
+    }
+#endif
+    const size_t end = path.find_last_of("/\\");
+    return end == std::string::npos ? "" : path.substr(0, end + 1);
+  }
+
+  bool Open(const std::string &dir, const int index) {
+    const std::string path = dir + GPTJ_LIBRARY_PREFIX + "gptj-" +
+                             gptj_instructions[index] + GPTJ_LIBRARY_SUFFIX;
+#ifdef _WIN32
+    handle_ = (void *)LoadLibraryA(path.c_str());
+#else
+    handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+    index_ = index;
+    return handle_ != nullptr;
+  }
+
+  void *handle_ = nullptr;
+  int index_ = -1;
+};
+
+const GptjLibrary &GetLibrary() {
+  static const GptjLibrary library;
+  return library;
+}
+
+}  // namespace
+
+// Calls the function of the loaded build with the same name. The function is
+// looked up on the first call.
+#define GPTJ_FORWARD(name, ...)                                  \
+  static const auto fn =                                         \
+      reinterpret_cast<decltype(&name)>(GetLibrary().Symbol(#name)); \
+  return fn(__VA_ARGS__)
+
+const char *gptj_cpu_instructions() {
+  const int index = gptj_cpu_instructions_index();
+  return index < 0 ? "" : gptj_instructions[index];
+}
+
+// Returns the instructions of the loaded build, or "" if none could be loaded.
+const char *gptj_build_instructions() {
+  if (!GetLibrary().Loaded()) {
+    return "";
+  }
+  GPTJ_FORWARD(gptj_build_instructions);
+}
+
+gptj_model_context *gptj_load_model(const char *filename) {
+  if (!GetLibrary().Loaded()) {
+    return nullptr;
+  }
+  GPTJ_FORWARD(gptj_load_model, filename);
+}
+
+gptj_model_context *gptj_load_model_with_params(const char *filename,
+                                                gptj_load_params params) {
+  if (!GetLibrary().Loaded()) {
+    return nullptr;
+  }
+  GPTJ_FORWARD(gptj_load_model_with_params, filename, params);
+}
+
+const char *gptj_json_grammar() {
+  if (!GetLibrary().Loaded()) {
+    return "";
+  }
+  GPTJ_FORWARD(gptj_json_grammar);
+}
+
+// The other functions take a model context, so a build is loaded.
+
+void gptj_free_model(gptj_model_context *ctx) {
+  GPTJ_FORWARD(gptj_free_model, ctx);
+}
+
+bool gptj_generate(gptj_model_context *model_ctx, const char *prompt,
+                   gptj_params params, bool reset,
+                   bool (*callback)(const char *token)) {
+  GPTJ_FORWARD(gptj_generate, model_ctx, prompt, params, reset, callback);
+}
+
+bool gptj_beam_search(gptj_model_context *model_ctx, const char *prompt,
+                      gptj_params params, int n_beams, int n_best, bool reset,
+                      bool (*callback)(int index, const char *token)) {
+  GPTJ_FORWARD(gptj_beam_search, model_ctx, prompt, params, n_beams, n_best,
+               reset, callback);
+}
+
+bool gptj_generate_n(gptj_model_context *model_ctx, const char *prompt,
+                     gptj_params params, int n, bool reset,
+                     bool (*callback)(int index, const char *token)) {
+  GPTJ_FORWARD(gptj_generate_n, model_ctx, prompt, params, n, reset, callback);
+}
+
+bool gptj_embeddings(gptj_model_context *model_ctx, const char **texts,
+                     int n_texts, gptj_params params, int layer, int pooling,
+                     float *embeddings) {
+  GPTJ_FORWARD(gptj_embeddings, model_ctx, texts, n_texts, params, layer,
+               pooling, embeddings);
+}
+
+bool gptj_score(gptj_model_context *model_ctx, const char *prompt,
+                const char **continuations, int n_continuations,
+                gptj_params params, bool reset, float *logprobs) {
+  GPTJ_FORWARD(gptj_score, model_ctx, prompt, continuations, n_continuations,
+               params, reset, logprobs);
+}
+
+bool gptj_eval_logits(gptj_model_context *model_ctx, const int *tokens,
+                      int n_tokens, gptj_params params, bool reset,
+                      float *logits) {
+  GPTJ_FORWARD(gptj_eval_logits, model_ctx, tokens, n_tokens, params, reset,
+               logits);
+}
+
+bool gptj_warmup(gptj_model_context *model_ctx, gptj_params params,
+                 bool background) {
+  GPTJ_FORWARD(gptj_warmup, model_ctx, params, background);
+}
+
+bool gptj_join_warmup(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_join_warmup, model_ctx);
+}
+
+int gptj_tokenize(gptj_model_context *model_ctx, const char *text,
+                  int *tokens, int n_max_tokens) {
+  GPTJ_FORWARD(gptj_tokenize, model_ctx, text, tokens, n_max_tokens);
+}
+
+int gptj_num_ctx(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_num_ctx, model_ctx);
+}
+
+int gptj_num_vocab(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_num_vocab, model_ctx);
+}
+
+int gptj_num_embd(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_num_embd, model_ctx);
+}
+
+int gptj_num_tokens(gptj_model_context *model_ctx, const char *prompt) {
+  GPTJ_FORWARD(gptj_num_tokens, model_ctx, prompt);
+}
+
+int gptj_num_past_tokens(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_num_past_tokens, model_ctx);
+}
+
+bool gptj_truncate(gptj_model_context *model_ctx, int n_past) {
+  GPTJ_FORWARD(gptj_truncate, model_ctx, n_past);
+}
+
+void gptj_get_stats(gptj_model_context *model_ctx, bool session,
+                    gptj_stats *stats) {
+  GPTJ_FORWARD(gptj_get_stats, model_ctx, session, stats);
+}
+
+void gptj_reset_stats(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_reset_stats, model_ctx);
+}
+
+void gptj_set_profiling(gptj_model_context *model_ctx, bool enabled) {
+  GPTJ_FORWARD(gptj_set_profiling, model_ctx, enabled);
+}
+
+void gptj_reset_profile(gptj_model_context *model_ctx) {
+  GPTJ_FORWARD(gptj_reset_profile, model_ctx);
+}
+
+bool gptj_write_profile(gptj_model_context *model_ctx, const char *filename,
+                        int format) {
+  GPTJ_FORWARD(gptj_write_profile, model_ctx, filename, format);
+}
@@ -0,0 +1,100 @@
+#ifndef GPTJ_CPU_H
+#define GPTJ_CPU_H
+
+#include <cstdint>
+#include <cstring>
+
+// The instruction sets that the library is built for and the detection of the
+// ones that the CPU supports, which picks the build to load.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define GPTJ_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// Instruction sets that ggml can be built for, from slowest to fastest. Each
+// one includes the ones before it.
+const char *const gptj_instructions[] = {"basic", "avx", "avx2", "avx512"};
+const int gptj_n_instructions =
+    sizeof(gptj_instructions) / sizeof(gptj_instructions[0]);
+
+// Returns the index of the instructions or -1 if they are unknown.
+inline int gptj_instructions_index(const char *name) {
+  for (int i = 0; i < gptj_n_instructions; i++) {
+    if (std::strcmp(name, gptj_instructions[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns the index of the fastest instructions that the CPU and OS support.
+// This is compiled without any instruction set flags so it is safe to call on
+// any x86 CPU.
+inline int gptj_cpu_instructions_index() {
+#ifdef GPTJ_X86
+  auto cpuid = [](const unsigned leaf, const unsigned subleaf,
+                  unsigned regs[4]) {
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+  };
+  // registers enabled by the OS
+  auto xgetbv = []() -> uint64_t {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+  };
+
+  unsigned regs[4] = {0};
+  cpuid(0, 0, regs);
+  const unsigned max_leaf = regs[0];
+
+  cpuid(1, 0, regs);
+  const unsigned ecx1 = regs[2];
+  const bool osxsave = ecx1 & (1u << 27);
+  const uint64_t xcr0 = osxsave ? xgetbv() : 0;
+  const bool ymm = (xcr0 & 0x6) == 0x6;
+  const bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+  unsigned ebx7 = 0;
+  if (max_leaf >= 7) {
+    cpuid(7, 0, regs);
+    ebx7 = regs[1];
+  }
+
+  const bool fma = ecx1 & (1u << 12);
+  const bool avx = (ecx1 & (1u << 28)) && ymm;
+  const bool f16c = ecx1 & (1u << 29);
+  const bool avx2 = ebx7 & (1u << 5);
+  const bool avx512 = zmm && (ebx7 & (1u << 16)) /* F */ &&
+                      (ebx7 & (1u << 30)) /* BW */ &&
+                      (ebx7 & (1u << 31)) /* VL */;
+
+  if (!(avx && f16c)) {
+    return 0;
+  }
+  if (!(avx2 && fma)) {
+    return 1;
+  }
+  if (!avx512) {
+    return 2;
+  }
+  return 3;
+#else
+  return -1;
+#endif
+}
+
+#endif  // GPTJ_CPU_H
@@ -0,0 +1,471 @@
+#ifndef GPTJ_FILE_H
+#define GPTJ_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ggml/ggml.h"
+
+// Model files are in one of two formats.
+//
+// The ggml format stores each tensor header followed by its data, so it can
+// only be read sequentially:
+//
+//   uint32 magic (GPTJ_FILE_MAGIC)
+//   int32  n_vocab, n_ctx, n_embd, n_head, n_layer, n_rot, ftype
+//   int32  n_vocab, then each token as uint32 length and bytes
+//   each tensor as int32 n_dims, name length, ttype, ne[n_dims], name, data
+//
+// The indexed format has a directory of the tensors before their data, and
+// the data of each tensor starts at a multiple of the alignment:
+//
+//   uint32 magic (GPTJ_FILE_MAGIC_INDEXED)
+//   uint32 version (GPTJ_FILE_VERSION)
+//   int32  n_vocab, n_ctx, n_embd, n_head, n_layer, n_rot, ftype
+//   uint32 alignment
+//   the prebuilt vocab (before version 2, the vocab of the ggml format)
+//   int32  n_tensors, then each tensor as gptj_file_tensor
+//   padding and tensor data
+//
+// The prebuilt vocab is read as is, without parsing each token:
+//
+//   int32  n_vocab
+//   uint32 pool size, then the pool of the tokens, each followed by '\0'
+//   uint32 offset of each token in the pool and of the end of the pool
+//   uint32 n_slots, then int32 id of each slot of a hash table of the tokens
+//          with linear probing from gptj_file_token_hash(token) % n_slots,
+//          where n_slots is a power of 2 (-1 = empty slot)
+//
+// Each tensor has its own type, so the weight matrices can have different
+// types. ftype is then the type of most of them.
+
+#define GPTJ_FILE_MAGIC 0x67676d6c          // "ggml"
+#define GPTJ_FILE_MAGIC_INDEXED 0x676a7469  // "gjti"
+#define GPTJ_FILE_VERSION 2
+#define GPTJ_FILE_VERSION_MIN 1    // oldest indexed version that can be read
+#define GPTJ_FILE_VERSION_VOCAB 2  // first version with the prebuilt vocab
+#define GPTJ_FILE_ALIGNMENT 64
+
+// Directory entry of a tensor in the indexed format.
+struct gptj_file_tensor {
+  std::string name;
+  int32_t ttype = 0;
+  int32_t n_dims = 0;
+  int32_t ne[2] = {1, 1};
+  uint64_t offset = 0;  // from the start of the file
+  uint64_t size = 0;    // in bytes
+
+  bool Read(std::istream &in) {
+    uint32_t length = 0;
+    in.read((char *)&length, sizeof(length));
+    if (!in || length > 1024) {
+      return false;
+    }
+    name.resize(length);
+    in.read(&name[0], length);
+    in.read((char *)&ttype, sizeof(ttype));
+    in.read((char *)&n_dims, sizeof(n_dims));
+    if (!in || n_dims < 1 || n_dims > 2) {
+      return false;
+    }
+    ne[0] = ne[1] = 1;
+    in.read((char *)ne, sizeof(ne[0]) * n_dims);
+    in.read((char *)&offset, sizeof(offset));
+    in.read((char *)&size, sizeof(size));
+    return (bool)in;
+  }
+
+  void Write(std::ostream &out) const {
+    const uint32_t length = name.size();
+    out.write((const char *)&length, sizeof(length));
+    out.write(name.data(), length);
+    out.write((const char *)&ttype, sizeof(ttype));
+    out.write((const char *)&n_dims, sizeof(n_dims));
+    out.write((const char *)ne, sizeof(ne[0]) * n_dims);
+    out.write((const char *)&offset, sizeof(offset));
+    out.write((const char *)&size, sizeof(size));
+  }
+
+  // Number of bytes written by Write().
+  size_t WrittenSize() const {
+    return sizeof(uint32_t) + name.size() + 2 * sizeof(int32_t) +
+           n_dims * sizeof(int32_t) + 2 * sizeof(uint64_t);
+  }
+};
+
+inline uint64_t gptj_file_align(const uint64_t offset,
+                                const uint64_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Returns the ggml type with the given name, such as "q4_0", or
+// GGML_TYPE_COUNT.
+inline ggml_type gptj_type_from_name(const std::string &name) {
+  for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+    const char *type_name = ggml_type_name((ggml_type)i);
+    if (type_name != nullptr && name == type_name) {
+      return (ggml_type)i;
+    }
+  }
+  return GGML_TYPE_COUNT;
+}
+
+// Returns the ftype of a model with weight matrices of the given type.
+inline int32_t gptj_ftype_from_type(const ggml_type type) {
+  switch (type) {
+    case GGML_TYPE_F32: return GGML_FTYPE_ALL_F32;
+    case GGML_TYPE_F16: return GGML_FTYPE_MOSTLY_F16;
+    case GGML_TYPE_Q4_0: return GGML_FTYPE_MOSTLY_Q4_0;
+    case GGML_TYPE_Q4_1: return GGML_FTYPE_MOSTLY_Q4_1;
+    case GGML_TYPE_Q5_0: return GGML_FTYPE_MOSTLY_Q5_0;
+    case GGML_TYPE_Q5_1: return GGML_FTYPE_MOSTLY_Q5_1;
+    case GGML_TYPE_Q8_0: return GGML_FTYPE_MOSTLY_Q8_0;
+    default: return GGML_FTYPE_UNKNOWN;
+  }
+}
+
+// Returns whether ttype is a ggml type that tensor data can have. The types
+// that ggml removed, such as q4_2, have a block size of 0.
+inline bool gptj_file_valid_type(const int32_t ttype) {
+  return ttype >= 0 && ttype < GGML_TYPE_COUNT &&
+         ggml_blck_size((ggml_type)ttype) > 0;
+}
+
+// Returns the number of bytes from the position of in to its end, which
+// bounds the sizes read from the file before anything is allocated for them.
+inline uint64_t gptj_file_remaining(std::istream &in) {
+  const std::streampos pos = in.tellg();
+  if (!in || pos < 0) {
+    return 0;
+  }
+  in.seekg(0, std::ios::end);
+  const std::streampos end = in.tellg();
+  in.seekg(pos);
+  return end > pos ? (uint64_t)(end - pos) : 0;
+}
+
+// Size in bytes of the data of a tensor.
+inline uint64_t gptj_file_tensor_size(const int32_t ttype,
+                                      const int32_t ne[2]) {
+  return (uint64_t)ne[0] * ne[1] * ggml_type_size((ggml_type)ttype) /
+         ggml_blck_size((ggml_type)ttype);
+}
+
+// FNV-1a hash of a token, used by the hash table of the vocab.
+inline uint32_t gptj_file_token_hash(const std::string_view token) {
+  uint32_t h = 2166136261u;
+  for (const char c : token) {
+    h = (h ^ (uint8_t)c) * 16777619u;
+  }
+  return h;
+}
+
+// Builds the hash table of the tokens in pool at offsets. A token that is in
+// the vocab more than once has its last id.
+inline std::vector<int32_t> gptj_file_token_table(
+    const std::string &pool, const std::vector<uint32_t> &offsets) {
+  const int32_t n_vocab = offsets.size() - 1;
+  auto token = [&](const int32_t id) {
+    return std::string_view(pool.data() + offsets[id],
+                            offsets[id + 1] - offsets[id] - 1);
+  };
+  size_t n_slots = 16;
+  while (n_slots < 2 * (size_t)n_vocab) {
+    n_slots *= 2;
+  }
+  std::vector<int32_t> table(n_slots, -1);
+  const uint32_t mask = n_slots - 1;
+  for (int32_t id = 0; id < n_vocab; id++) {
+    uint32_t i = gptj_file_token_hash(token(id)) & mask;
+    while (table[i] >= 0 && token(table[i]) != token(id)) {
+      i = (i + 1) & mask;
+    }
+    table[i] = id;
+  }
+  return table;
+}
+
+// Reads the vocab of n_vocab tokens into a pool of the tokens, each followed
+// by '\0', the offset of each token and of the end of the pool, and the hash
+// table of the tokens. A prebuilt vocab is read with one read of each array,
+// otherwise the tokens are read one by one and the table is built.
+inline bool gptj_file_read_vocab(std::istream &in, const bool prebuilt,
+                                 const int32_t n_vocab, std::string &pool,
+                                 std::vector<uint32_t> &offsets,
+                                 std::vector<int32_t> &table) {
+  int32_t n_vocab_file = 0;
+  in.read((char *)&n_vocab_file, sizeof(n_vocab_file));
+  if (!in || n_vocab < 0 || n_vocab_file != n_vocab) {
+    return false;
+  }
+
+  const uint64_t remaining = gptj_file_remaining(in);
+  if (!prebuilt) {
+    pool.clear();
+    offsets.assign(1, 0);
+    for (int i = 0; i < n_vocab; i++) {
+      uint32_t len = 0;
+      in.read((char *)&len, sizeof(len));
+      if (!in || len > remaining) {
+        return false;
+      }
+      const size_t start = pool.size();
+      pool.resize(start + len + 1);
+      in.read(&pool[start], len);
+      offsets.push_back(pool.size());
+    }
+    table = gptj_file_token_table(pool, offsets);
+    return (bool)in;
+  }
+
+  uint32_t pool_size = 0;
+  in.read((char *)&pool_size, sizeof(pool_size));
+  if (!in || pool_size + sizeof(uint32_t) * ((uint64_t)n_vocab + 1) >
+                 remaining) {
+    return false;
+  }
+  pool.resize(pool_size);
+  in.read(&pool[0], pool_size);
+  offsets.resize((size_t)n_vocab + 1);
+  in.read((char *)offsets.data(), sizeof(uint32_t) * offsets.size());
+  uint32_t n_slots = 0;
+  in.read((char *)&n_slots, sizeof(n_slots));
+  if (!in || n_slots <= (uint32_t)n_vocab || (n_slots & (n_slots - 1)) != 0 ||
+      sizeof(int32_t) * (uint64_t)n_slots > gptj_file_remaining(in)) {
+    return false;
+  }
+  table.resize(n_slots);
+  in.read((char *)table.data(), sizeof(int32_t) * table.size());
+  if (!in || offsets[0] != 0 || offsets[n_vocab] != pool_size) {
+    return false;
+  }
+  for (int i = 0; i < n_vocab; i++) {
+    if (offsets[i] >= offsets[i + 1] || pool[offsets[i + 1] - 1] != '\0') {
+      return false;
+    }
+  }
+  // the table must have an empty slot for the probing to end
+  bool has_empty_slot = false;
+  for (const int32_t id : table) {
+    if (id < -1 || id >= n_vocab) {
+      return false;
+    }
+    has_empty_slot = has_empty_slot || id == -1;
+  }
+  return has_empty_slot;
+}
+
+// Writes the vocab read by gptj_file_read_vocab().
+inline void gptj_file_write_vocab(std::ostream &out, const bool prebuilt,
+                                  const std::string &pool,
+                                  const std::vector<uint32_t> &offsets) {
+  const int32_t n_vocab = offsets.size() - 1;
+  out.write((const char *)&n_vocab, sizeof(n_vocab));
+  if (!prebuilt) {
+    for (int i = 0; i < n_vocab; i++) {
+      const uint32_t len = offsets[i + 1] - offsets[i] - 1;
+      out.write((const char *)&len, sizeof(len));
+      out.write(pool.data() + offsets[i], len);
+    }
+    return;
+  }
+
+  const uint32_t pool_size = pool.size();
+  out.write((const char *)&pool_size, sizeof(pool_size));
+  out.write(pool.data(), pool.size());
+  out.write((const char *)offsets.data(), sizeof(uint32_t) * offsets.size());
+  const std::vector<int32_t> table = gptj_file_token_table(pool, offsets);
+  const uint32_t n_slots = table.size();
+  out.write((const char *)&n_slots, sizeof(n_slots));
+  out.write((const char *)table.data(), sizeof(int32_t) * table.size());
+}
+
+// Reads the directory of an indexed file or scans the tensor headers of a
+// ggml file, starting after the vocab. The data is not read.
+inline bool gptj_file_read_tensors(std::istream &in, const bool indexed,
+                                   std::vector<gptj_file_tensor> &tensors) {
+  tensors.clear();
+  if (indexed) {
+    int32_t n_tensors = 0;
+    in.read((char *)&n_tensors, sizeof(n_tensors));
+    // each entry has at least a name length, ttype, n_dims, ne[0], offset and
+    // size
+    const uint64_t min_entry_size = 4 * sizeof(int32_t) + 2 * sizeof(uint64_t);
+    if (!in || n_tensors < 0 ||
+        n_tensors * min_entry_size > gptj_file_remaining(in)) {
+      return false;
+    }
+    tensors.resize(n_tensors);
+    for (auto &tensor : tensors) {
+      if (!tensor.Read(in) || !gptj_file_valid_type(tensor.ttype)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  while (true) {
+    gptj_file_tensor tensor;
+    int32_t length = 0;
+    in.read((char *)&tensor.n_dims, sizeof(tensor.n_dims));
+    in.read((char *)&length, sizeof(length));
+    in.read((char *)&tensor.ttype, sizeof(tensor.ttype));
+    if (in.eof()) {
+      in.clear();
+      return true;
+    }
+    if (tensor.n_dims < 1 || tensor.n_dims > 2 || length < 0 ||
+        length > 1024 || !gptj_file_valid_type(tensor.ttype)) {
+      return false;
+    }
+    in.read((char *)tensor.ne, sizeof(tensor.ne[0]) * tensor.n_dims);
+    tensor.name.resize(length);
+    in.read(&tensor.name[0], length);
+    tensor.size = gptj_file_tensor_size(tensor.ttype, tensor.ne);
+    tensor.offset = in.tellg();
+    in.seekg(tensor.size, std::ios::cur);
+    tensors.push_back(tensor);
+  }
+}
+
+// The header of a model file in either format, used by the tools that rewrite
+// model files.
+struct gptj_file_model {
+  bool indexed = false;
+  uint32_t version = GPTJ_FILE_VERSION;  // of the indexed format
+  int32_t hparams[7] = {};  // n_vocab, n_ctx, n_embd, n_head, n_layer, n_rot,
+                            // ftype
+  uint32_t alignment = GPTJ_FILE_ALIGNMENT;
+  // the tokens, each followed by '\0', and the offset of each token and of
+  // the end of the pool
+  std::string token_pool;
+  std::vector<uint32_t> token_offsets;
+  std::vector<gptj_file_tensor> tensors;  // with the offsets of their data
+
+  // Reads the header and finds the tensors. The data is not read.
+  bool Read(std::istream &in) {
+    uint32_t magic = 0;
+    in.read((char *)&magic, sizeof(magic));
+    indexed = magic == GPTJ_FILE_MAGIC_INDEXED;
+    if (indexed) {
+      in.read((char *)&version, sizeof(version));
+      if (version < GPTJ_FILE_VERSION_MIN || version > GPTJ_FILE_VERSION) {
+        return false;
+      }
+    } else if (magic != GPTJ_FILE_MAGIC) {
+      return false;
+    }
+
+    in.read((char *)hparams, sizeof(hparams));
+    if (indexed) {
+      in.read((char *)&alignment, sizeof(alignment));
+    }
+
+    std::vector<int32_t> token_table;
+    if (!gptj_file_read_vocab(in, indexed && version >= GPTJ_FILE_VERSION_VOCAB,
+                              hparams[0], token_pool, token_offsets,
+                              token_table)) {
+      return false;
+    }
+
+    return gptj_file_read_tensors(in, indexed, tensors);
+  }
+
+  // Writes the header. In the indexed format, the header is written in the
+  // current version and the offsets of the tensors are set from their sizes
+  // first.
+  void WriteHeader(std::ostream &out) {
+    const uint32_t magic = indexed ? GPTJ_FILE_MAGIC_INDEXED : GPTJ_FILE_MAGIC;
+    out.write((const char *)&magic, sizeof(magic));
+    if (!indexed) {
+      out.write((const char *)hparams, sizeof(hparams));
+      gptj_file_write_vocab(out, false, token_pool, token_offsets);
+      return;
+    }
+
+    version = GPTJ_FILE_VERSION;
+    std::ostringstream vocab;
+    gptj_file_write_vocab(vocab, true, token_pool, token_offsets);
+    const std::string vocab_data = vocab.str();
+
+    uint64_t offset = sizeof(uint32_t) * 2 + sizeof(hparams) +
+                      sizeof(uint32_t) + vocab_data.size() + sizeof(int32_t);
+    for (const auto &tensor : tensors) {
+      offset += tensor.WrittenSize();
+    }
+    for (auto &tensor : tensors) {
+      offset = gptj_file_align(offset, alignment);
+      tensor.offset = offset;
+      offset += tensor.size;
+    }
+
+    out.write((const char *)&version, sizeof(version));
+    out.write((const char *)hparams, sizeof(hparams));
+    out.write((const char *)&alignment, sizeof(alignment));
+    out.write(vocab_data.data(), vocab_data.size());
+    const int32_t n_tensors = tensors.size();
+    out.write((const char *)&n_tensors, sizeof(n_tensors));
+    for (const auto &tensor : tensors) {
+      tensor.Write(out);
+    }
+  }
+
+  // Writes the model to out in the indexed format with the given alignment.
+  // The data of the tensors is copied from in, where it is at the offsets
+  // found by Read().
+  bool WriteIndexed(std::istream &in, std::ostream &out,
+                    const uint32_t alignment_out) {
+    std::vector<uint64_t> offsets_in;
+    for (const auto &tensor : tensors) {
+      offsets_in.push_back(tensor.offset);
+    }
+
+    indexed = true;
+    alignment = alignment_out;
+    WriteHeader(out);
+
+    std::vector<char> buf(1 << 20);
+    for (int i = 0; i < (int)tensors.size(); i++) {
+      const gptj_file_tensor &tensor = tensors[i];
+      WriteTensorHeader(out, i);
+
+      in.seekg(offsets_in[i]);
+      for (uint64_t done = 0; done < tensor.size;) {
+        const size_t n = std::min<uint64_t>(buf.size(), tensor.size - done);
+        in.read(buf.data(), n);
+        out.write(buf.data(), n);
+        done += n;
+      }
+      if (!in) {
+        return false;
+      }
+    }
+    return (bool)out;
+  }
+
+  // Writes what comes before the data of the i-th tensor, which is the padding
+  // in the indexed format and the tensor header in the ggml format. The tensors
+  // must be written in order after the header, each followed by its data.
+  void WriteTensorHeader(std::ostream &out, const int i) const {
+    const gptj_file_tensor &tensor = tensors[i];
+    if (indexed) {
+      const std::string padding(tensor.offset - (uint64_t)out.tellp(), 0);
+      out.write(padding.data(), padding.size());
+    } else {
+      const int32_t length = tensor.name.size();
+      out.write((const char *)&tensor.n_dims, sizeof(tensor.n_dims));
+      out.write((const char *)&length, sizeof(length));
+      out.write((const char *)&tensor.ttype, sizeof(tensor.ttype));
+      out.write((const char *)tensor.ne, sizeof(tensor.ne[0]) * tensor.n_dims);
+      out.write(tensor.name.data(), length);
+    }
+  }
+};
+
+#endif  // GPTJ_FILE_H
@@ -0,0 +1,254 @@
+#ifndef GPTJ_INTERNAL_H
+#define GPTJ_INTERNAL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "ggml/ggml.h"
+#include "gptj-file.h"
+#include "gptj.h"
+
+// Types and functions of gptj.cpp that are not part of the API in gptj.h, for
+// the tools and benchmarks that are linked with its objects rather than with
+// the gptj library.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Utils
+ */
+
+// The tokens are stored one after another in a pool, each followed by '\0',
+// with the offset of each token. The id of a token is found in an open
+// addressing hash table with linear probing, so that there is no allocation
+// per token. The arrays are as in a prebuilt vocab, see gptj-file.h.
+struct gpt_vocab {
+  using id = int32_t;
+
+  std::string pool;
+  std::vector<uint32_t> offsets;  // of each token and of the end of the pool
+  std::vector<id> table;  // size is a power of 2, -1 = empty
+
+  std::vector<std::string> special_tokens;
+
+  void add_special_token(const std::string &token) {
+    special_tokens.push_back(token);
+  }
+
+  int size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+  std::string_view token(const id i) const {
+    return std::string_view(pool.data() + offsets[i],
+                            offsets[i + 1] - offsets[i] - 1);
+  }
+
+  const char *c_token(const id i) const { return pool.data() + offsets[i]; }
+
+  // Returns the id of a token or -1. A token added more than once has its
+  // last id.
+  id find(const std::string_view token) const {
+    if (table.empty()) {
+      return -1;
+    }
+    const uint32_t mask = table.size() - 1;
+    for (uint32_t i = gptj_file_token_hash(token) & mask;;
+         i = (i + 1) & mask) {
+      if (table[i] < 0 || this->token(table[i]) == token) {
+        return table[i];
+      }
+    }
+  }
+
+  // Adds the next token. build_table() must be called after the last one.
+  void add(const std::string_view token) {
+    if (offsets.empty()) {
+      offsets.push_back(0);
+    }
+    pool.append(token);
+    pool += '\0';
+    offsets.push_back(pool.size());
+  }
+
+  void build_table() { table = gptj_file_token_table(pool, offsets); }
+};
+
+std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab &vocab,
+                                        const std::string &text);
+
+gpt_vocab::id gpt_sample_top_k_top_p(
+    const gpt_vocab &vocab, const float *logits, int top_k, double top_p,
+    double temp, const float repeat_penalty,
+    const std::unordered_set<gpt_vocab::id> &recent_tokens, std::mt19937 &rng);
+
+// Returns the log-probability of a token from the logits.
+double gpt_log_softmax(const float *logits, const int n_logits,
+                       const gpt_vocab::id id);
+
+/**
+ * GPT-J
+ */
+
+class GptjLayerPager;
+class GptjBuffer;
+class GptjProfile;
+
+// default hparams (GPT-J 6B)
+struct gptj_hparams {
+  int32_t n_vocab = 50400;
+  int32_t n_ctx = 2048;
+  int32_t n_embd = 4096;
+  int32_t n_head = 16;
+  int32_t n_layer = 28;
+  int32_t n_rot = 64;
+  int32_t ftype = 1;
+};
+
+struct gptj_layer {
+  // normalization
+  struct ggml_tensor *ln_1_g;
+  struct ggml_tensor *ln_1_b;
+
+  // attention
+  struct ggml_tensor *c_attn_q_proj_w;
+  struct ggml_tensor *c_attn_k_proj_w;
+  struct ggml_tensor *c_attn_v_proj_w;
+
+  struct ggml_tensor *c_attn_proj_w;
+
+  // ff
+  struct ggml_tensor *c_mlp_fc_w;
+  struct ggml_tensor *c_mlp_fc_b;
+
+  struct ggml_tensor *c_mlp_proj_w;
+  struct ggml_tensor *c_mlp_proj_b;
+};
+
+struct gptj_model {
+  gptj_hparams hparams;
+
+  // normalization
+  struct ggml_tensor *ln_f_g;
+  struct ggml_tensor *ln_f_b;
+
+  struct ggml_tensor *wte;  // position embedding
+
+  struct ggml_tensor *lmh_g;  // language model head
+  struct ggml_tensor *lmh_b;  // language model bias
+
+  std::vector<gptj_layer> layers;
+
+  // key + value memory
+  struct ggml_tensor *memory_k;
+  struct ggml_tensor *memory_v;
+
+  //
+  struct ggml_context *ctx;
+  std::map<std::string, struct ggml_tensor *> tensors;
+
+  // lazily loaded layers, whose tensors are in their own context
+  GptjLayerPager *pager = nullptr;
+  struct ggml_context *ctx_layers = nullptr;
+
+  // memory of ctx if it's not allocated by ggml
+  GptjBuffer *buffer = nullptr;
+
+  // profile of the evaluated graphs (nullptr = disable profiling)
+  GptjProfile *profile = nullptr;
+};
+
+bool gptj_model_load(const std::string &fname, gptj_model &model,
+                     gpt_vocab &vocab, const gptj_load_params &params = {});
+
+void gptj_model_free(gptj_model &model);
+
+bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
+               const std::vector<gpt_vocab::id> &embd_inp,
+               std::vector<float> &embd_w, size_t &mem_per_token,
+               const bool logits_all = false);
+
+// https://github.com/marella/train/blob/3c4ba1f59bf20e31f7ee5ea9a8f38e49440a93f7/train/state.py#L135-L175
+class GptjRingBuffer {
+ public:
+  void Init(const int capacity) {
+    capacity_ = capacity;
+    Clear();
+  }
+
+  void Add(const gpt_vocab::id token) {
+    if (pos_ == tokens_.size()) {
+      tokens_.push_back(token);
+    } else {
+      tokens_[pos_] = token;
+    }
+    pos_ = (pos_ + 1) % capacity_;
+    size_ = std::min(size_ + 1, capacity_);
+  }
+
+  // Returns last n tokens.
+  std::unordered_set<gpt_vocab::id> GetRecent(int n) const {
+    const int length = tokens_.size();
+    n = std::min(Size(), n);
+    std::unordered_set<gpt_vocab::id> result;
+    if (n == 0) {
+      return result;
+    }
+    const int start = (pos_ - n + length) % length;
+    if (start < pos_) {
+      result.insert(tokens_.begin() + start, tokens_.begin() + pos_);
+    } else {
+      result.insert(tokens_.begin() + start, tokens_.end());
+      result.insert(tokens_.begin(), tokens_.begin() + pos_);
+    }
+    return result;
+  }
+
+  // Returns last n tokens in the order they were added.
+  std::vector<gpt_vocab::id> GetLast(int n) const {
+    const int length = tokens_.size();
+    n = std::min(Size(), n);
+    std::vector<gpt_vocab::id> result;
+    result.reserve(n);
+    for (int i = 0; i < n; i++) {
+      result.push_back(tokens_[(pos_ - n + i + length) % length]);
+    }
+    return result;
+  }
+
+  // Removes last n tokens.
+  void RemoveLast(int n) {
+    n = std::min(Size(), n);
+    if (n <= 0) {
+      return;
+    }
+    pos_ = (pos_ - n + capacity_) % capacity_;
+    size_ -= n;
+  }
+
+  void Clear() {
+    tokens_.clear();
+    pos_ = 0;
+    size_ = 0;
+  }
+
+  int Size() const { return size_; }
+
+ private:
+  int capacity_;
+  std::vector<gpt_vocab::id> tokens_;
+  int pos_ = 0;
+  int size_ = 0;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // GPTJ_INTERNAL_H
@@ -1,18 +1,50 @@
+#include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <cctype>
+#include <cerrno>
+#include <cfloat>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <queue>
 #include <random>
 #include <regex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "ggml/ggml.h"
+#include "gptj-cpu.h"
+#include "gptj-file.h"
+#include "gptj-internal.h"
+#include "gptj.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define GPTJ_MPOL_INTERLEAVE 3
+#endif
+
+// instructions that ggml was built for, set by CMake
+#ifndef GPTJ_INSTRUCTIONS
+#define GPTJ_INSTRUCTIONS ""
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,35 +54,6 @@ extern "C" {
  * Utils
  */
 
-struct gptj_params {
-  int32_t seed = -1;  // RNG seed
-  int32_t n_threads = std::min(4, (int32_t)std::thread::hardware_concurrency());
-  int32_t n_predict = 200;  // new tokens to predict
-
-  // sampling parameters
-  int32_t top_k = 40;
-  float top_p = 0.9f;
-  float temp = 0.9f;
-  float repeat_penalty = 1.0f;  // 1.0 = disabled
-  // last n tokens to penalize (0 = disable penalty, -1 = context size)
-  int32_t repeat_last_n = 64;
-
-  int32_t n_batch = 8;  // batch size for prompt processing
-};
-
-struct gpt_vocab {
-  using id = int32_t;
-  using token = std::string;
-
-  std::map<token, id> token_to_id;
-  std::map<id, token> id_to_token;
-  std::vector<std::string> special_tokens;
-
-  void add_special_token(const std::string &token) {
-    special_tokens.push_back(token);
-  }
-};
-
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab &vocab,
                                         const std::string &text) {
   std::vector<std::string> words;
@@ -96,9 +99,10 @@ std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab &vocab,
     while (i < n) {
       int j = n;
       while (j > i) {
-        auto it = vocab.token_to_id.find(word.substr(i, j - i));
-        if (it != vocab.token_to_id.end()) {
-          tokens.push_back(it->second);
+        const gpt_vocab::id id =
+            vocab.find(std::string_view(word).substr(i, j - i));
+        if (id >= 0) {
+          tokens.push_back(id);
           i = j;
           break;
         }
@@ -109,8 +113,9 @@ std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab &vocab,
       }
       if (j == i) {
         auto sub = word.substr(i, 1);
-        if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-          tokens.push_back(vocab.token_to_id.at(sub));
+        const gpt_vocab::id id = vocab.find(sub);
+        if (id >= 0) {
+          tokens.push_back(id);
         } else {
           fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
         }
@@ -126,7 +131,7 @@ gpt_vocab::id gpt_sample_top_k_top_p(
     const gpt_vocab &vocab, const float *logits, int top_k, double top_p,
     double temp, const float repeat_penalty,
     const std::unordered_set<gpt_vocab::id> &recent_tokens, std::mt19937 &rng) {
-  int n_logits = vocab.id_to_token.size();
+  int n_logits = vocab.size();
 
   std::vector<std::pair<double, gpt_vocab::id>> logits_id;
   logits_id.reserve(n_logits);
@@ -204,272 +209,1429 @@ gpt_vocab::id gpt_sample_top_k_top_p(
   return logits_id[idx].second;
 }
 
-/**
- * GPT-J
- */
-
-// default hparams (GPT-J 6B)
-struct gptj_hparams {
-  int32_t n_vocab = 50400;
-  int32_t n_ctx = 2048;
-  int32_t n_embd = 4096;
-  int32_t n_head = 16;
-  int32_t n_layer = 28;
-  int32_t n_rot = 64;
-  int32_t ftype = 1;
-};
-
-struct gptj_layer {
-  // normalization
-  struct ggml_tensor *ln_1_g;
-  struct ggml_tensor *ln_1_b;
-
-  // attention
-  struct ggml_tensor *c_attn_q_proj_w;
-  struct ggml_tensor *c_attn_k_proj_w;
-  struct ggml_tensor *c_attn_v_proj_w;
+// Returns e^x for x <= 0, or about 1e-38 for x < -87, with a relative error
+// below 1e-7. Unlike expf it has no calls, so that loops of it are vectorized.
+inline float gpt_exp(float x) {
+  x = std::max(x, -87.0f);
+  // e^x = 2^n * e^r with |r| <= ln(2) / 2
+  const int n = (int)(x * 1.44269504f - 0.5f);
+  const float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.0f;
+  return p * std::bit_cast<float>((n + 127) << 23);
+}
 
-  struct ggml_tensor *c_attn_proj_w;
+// Returns the log-probability of a token from the logits without computing
+// the probabilities of the other tokens. The logits are read once, in blocks
+// that are in the cache for both the max and the sum of e^(logit - max), and
+// the sum is rescaled when the max grows. Each of kLanes lanes has its own max
+// and sum so that the loops are vectorized.
+double gpt_log_softmax(const float *logits, const int n_logits,
+                       const gpt_vocab::id id) {
+  constexpr int kLanes = 8;
+  constexpr int kBlock = 8 * kLanes;
+  float lane_max[kLanes];
+  float lane_sum[kLanes];
+  // not -INFINITY, which would give NaN for lanes of masked logits
+  std::fill(lane_max, lane_max + kLanes, -FLT_MAX);
+  std::fill(lane_sum, lane_sum + kLanes, 0.0f);
+
+  int i = 0;
+  for (; i + kBlock <= n_logits; i += kBlock) {
+    const float *block = logits + i;
+    float block_max[kLanes];
+    std::copy(block, block + kLanes, block_max);
+    for (int j = kLanes; j < kBlock; j += kLanes) {
+      for (int l = 0; l < kLanes; l++) {
+        block_max[l] = std::max(block_max[l], block[j + l]);
+      }
+    }
+    for (int l = 0; l < kLanes; l++) {
+      const float maxl = std::max(lane_max[l], block_max[l]);
+      lane_sum[l] *= gpt_exp(lane_max[l] - maxl);
+      lane_max[l] = maxl;
+    }
+    for (int j = 0; j < kBlock; j += kLanes) {
+      for (int l = 0; l < kLanes; l++) {
+        lane_sum[l] += gpt_exp(block[j + l] - lane_max[l]);
+      }
+    }
+  }
 
-  // ff
-  struct ggml_tensor *c_mlp_fc_w;
-  struct ggml_tensor *c_mlp_fc_b;
+  // the lanes and the logits after the last block
+  float maxl = *std::max_element(lane_max, lane_max + kLanes);
+  for (int j = i; j < n_logits; j++) {
+    maxl = std::max(maxl, logits[j]);
+  }
+  double sum = 0.0;
+  for (int l = 0; l < kLanes; l++) {
+    sum += lane_sum[l] * gpt_exp(lane_max[l] - maxl);
+  }
+  for (int j = i; j < n_logits; j++) {
+    sum += gpt_exp(logits[j] - maxl);
+  }
+  return logits[id] - maxl - log(sum);
+}
 
-  struct ggml_tensor *c_mlp_proj_w;
-  struct ggml_tensor *c_mlp_proj_b;
-};
+/**
+ * Grammar
+ */
 
-struct gptj_model {
-  gptj_hparams hparams;
+// Grammars use a subset of GBNF:
+//
+//   root   ::= "{" ws pair ("," ws pair)* "}"
+//   pair   ::= [a-z]+ ":" ws [0-9]+ ws
+//   ws     ::= [ \t\n]*
+//
+// Rules are made of literals, character classes, references to other rules and
+// groups, which can be repeated with *, + and ?. Characters are matched as
+// bytes of the UTF-8 encoded text. Left recursive rules are not supported.
+
+// https://github.com/ggerganov/llama.cpp/blob/master/grammars/json.gbnf
+const char *gptj_json_grammar() {
+  return R"gbnf(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\\x7F\x00-\x1F] |
+    "\\" (["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F])
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]*)) ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws
+
+ws ::= ([ \t\n] ws)?
+)gbnf";
+}
 
-  // normalization
-  struct ggml_tensor *ln_f_g;
-  struct ggml_tensor *ln_f_b;
+// A trie of the tokens in the vocabulary.
+class GptjTokenTrie {
+ public:
+  struct Node {
+    std::vector<std::pair<uint8_t, int>> children;
+    std::vector<gpt_vocab::id> tokens;  // tokens that end at this node
+  };
 
-  struct ggml_tensor *wte;  // position embedding
+  void Build(const gpt_vocab &vocab) {
+    nodes_.assign(1, Node());
+    for (gpt_vocab::id id = 0; id < vocab.size(); id++) {
+      int node = 0;
+      for (const char c : vocab.token(id)) {
+        node = Child(node, c);
+      }
+      if (node != 0) {
+        nodes_[node].tokens.push_back(id);
+      }
+    }
+  }
 
-  struct ggml_tensor *lmh_g;  // language model head
-  struct ggml_tensor *lmh_b;  // language model bias
+  bool Empty() const { return nodes_.empty(); }
 
-  std::vector<gptj_layer> layers;
+  const Node &Get(const int node) const { return nodes_[node]; }
 
-  // key + value memory
-  struct ggml_tensor *memory_k;
-  struct ggml_tensor *memory_v;
+ private:
+  int Child(const int node, const uint8_t c) {
+    for (const auto &child : nodes_[node].children) {
+      if (child.first == c) {
+        return child.second;
+      }
+    }
+    nodes_.emplace_back();
+    nodes_[node].children.emplace_back(c, nodes_.size() - 1);
+    return nodes_.size() - 1;
+  }
 
-  //
-  struct ggml_context *ctx;
-  std::map<std::string, struct ggml_tensor *> tensors;
+  std::vector<Node> nodes_;
 };
 
-// load the model's weights from a file
-bool gptj_model_load(const std::string &fname, gptj_model &model,
-                     gpt_vocab &vocab) {
-  auto fin = std::ifstream(fname, std::ios::binary);
-  if (!fin) {
-    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
-    return false;
-  }
-
-  // verify magic
-  {
-    uint32_t magic;
-    fin.read((char *)&magic, sizeof(magic));
-    if (magic != 0x67676d6c) {
-      fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__,
-              fname.c_str());
+class GptjGrammar {
+ public:
+  // A parse state is a set of stacks of positions in the grammar. The top of a
+  // stack is always a character class, and an empty stack means the input
+  // matched the whole grammar.
+  using Stack = std::vector<int>;
+  using Stacks = std::vector<Stack>;
+
+  bool Parse(const std::string &text) {
+    text_ = text.c_str();
+    pos_ = text_;
+    elements_.clear();
+    rules_.clear();
+    rule_ids_.clear();
+    rule_names_.clear();
+    defined_.clear();
+    charsets_.clear();
+    masks_.clear();
+
+    ParseSpace(true);
+    while (*pos_) {
+      if (!ParseRule()) {
+        fprintf(stderr, "%s: failed to parse grammar at '%.20s'\n", __func__,
+                pos_);
+        return false;
+      }
+      ParseSpace(true);
+    }
+    for (const auto &kv : rule_ids_) {
+      if (defined_.find(kv.second) == defined_.end()) {
+        fprintf(stderr, "%s: undefined rule '%s' in grammar\n", __func__,
+                kv.first.c_str());
+        return false;
+      }
+    }
+    if (rule_ids_.find("root") == rule_ids_.end()) {
+      fprintf(stderr, "%s: grammar has no root rule\n", __func__);
+      return false;
+    }
+    // Advance expands rules until a character, which never ends for these
+    const int cycle = FindEmptyCycle();
+    if (cycle >= 0) {
+      fprintf(stderr,
+              "%s: rule '%s' in grammar can repeat without matching a "
+              "character, such as a left recursive rule or a repetition of a "
+              "rule that can be empty\n",
+              __func__, rule_names_[cycle].c_str());
       return false;
     }
-  }
-
-  // load hparams
-  {
-    auto &hparams = model.hparams;
 
-    fin.read((char *)&hparams.n_vocab, sizeof(hparams.n_vocab));
-    fin.read((char *)&hparams.n_ctx, sizeof(hparams.n_ctx));
-    fin.read((char *)&hparams.n_embd, sizeof(hparams.n_embd));
-    fin.read((char *)&hparams.n_head, sizeof(hparams.n_head));
-    fin.read((char *)&hparams.n_layer, sizeof(hparams.n_layer));
-    fin.read((char *)&hparams.n_rot, sizeof(hparams.n_rot));
-    fin.read((char *)&hparams.ftype, sizeof(hparams.ftype));
+    // the rules are stored one after another, alternatives separated by ALT
+    std::vector<std::vector<element>> rules = std::move(rules_);
+    rule_alts_.assign(rules.size(), {});
+    std::vector<int> rule_start(rules.size());
+    for (int r = 0; r < rules.size(); r++) {
+      rule_start[r] = elements_.size();
+      rule_alts_[r].push_back(elements_.size());
+      for (const element &e : rules[r]) {
+        elements_.push_back(e);
+        if (e.type == ALT) {
+          rule_alts_[r].push_back(elements_.size());
+        }
+      }
+      elements_.push_back({END, 0});
+    }
+    start_ = elements_.size();
+    elements_.push_back({RULE, rule_ids_["root"]});
+    elements_.push_back({END, 0});
+    return true;
   }
 
-  // load vocab
-  {
-    int32_t n_vocab = 0;
-    fin.read((char *)&n_vocab, sizeof(n_vocab));
+  Stacks Start() const {
+    Stacks stacks;
+    Advance({start_}, stacks);
+    return stacks;
+  }
 
-    if (n_vocab != model.hparams.n_vocab) {
-      fprintf(stderr, "%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-              __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-      return false;
+  // Returns the stacks after matching a character.
+  Stacks Accept(const Stacks &stacks, const uint8_t c) const {
+    Stacks result;
+    for (const Stack &stack : stacks) {
+      if (stack.empty() || !charsets_[elements_[stack.back()].value][c]) {
+        continue;
+      }
+      Stack next(stack.begin(), stack.end() - 1);
+      if (!IsEnd(stack.back() + 1)) {
+        next.push_back(stack.back() + 1);
+      }
+      Advance(next, result);
     }
+    return result;
+  }
 
-    std::string word;
-    for (int i = 0; i < n_vocab; i++) {
-      uint32_t len;
-      fin.read((char *)&len, sizeof(len));
-
-      word.resize(len);
-      fin.read((char *)word.data(), len);
-
-      vocab.token_to_id[word] = i;
-      vocab.id_to_token[i] = word;
+  Stacks AcceptToken(Stacks stacks, const std::string_view token) const {
+    for (const char c : token) {
+      if (stacks.empty()) {
+        break;
+      }
+      stacks = Accept(stacks, c);
     }
+    return stacks;
   }
 
-  // for the big tensors, we have the option to store the data in 16-bit floats
-  // or quantized in order to save memory and also to speed up the computation
-  ggml_type wtype = ggml_ftype_to_ggml_type((ggml_ftype)(model.hparams.ftype));
-  if (wtype == GGML_TYPE_COUNT) {
-    fprintf(stderr, "%s: invalid model file '%s' (bad ftype value %d)\n",
-            __func__, fname.c_str(), model.hparams.ftype);
+  static bool IsDone(const Stacks &stacks) {
+    for (const Stack &stack : stacks) {
+      if (stack.empty()) {
+        return true;
+      }
+    }
     return false;
   }
 
-  auto &ctx = model.ctx;
-
-  size_t ctx_size = 0;
-
-  {
-    const auto &hparams = model.hparams;
-
-    const int n_embd = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx = hparams.n_ctx;
-    const int n_vocab = hparams.n_vocab;
-
-    ctx_size += n_embd * ggml_type_sizef(GGML_TYPE_F32);  // ln_f_g
-    ctx_size += n_embd * ggml_type_sizef(GGML_TYPE_F32);  // ln_f_b
-
-    ctx_size += n_embd * n_vocab * ggml_type_sizef(wtype);  // wte
+  // Sets the logits of the tokens that can't come next to -INFINITY. The token
+  // masks of each parse state are computed once using the trie.
+  void Apply(const Stacks &stacks, const GptjTokenTrie &trie,
+             const gpt_vocab::id eos, float *logits, const int n_logits) {
+    std::string key;
+    for (const Stack &stack : stacks) {
+      key.append((const char *)stack.data(), stack.size() * sizeof(int));
+      key.append(sizeof(int), '\xff');
+    }
+    auto it = masks_.find(key);
+    if (it == masks_.end()) {
+      std::vector<uint64_t> mask((n_logits + 63) / 64);
+      Mask(trie, 0, stacks, mask);
+      it = masks_.emplace(key, std::move(mask)).first;
+    }
+    const std::vector<uint64_t> &mask = it->second;
+
+    const float eos_logit = eos < n_logits ? logits[eos] : 0.0f;
+    bool any = false;
+    for (int i = 0; i < n_logits; i++) {
+      if (!((mask[i / 64] >> (i % 64)) & 1)) {
+        logits[i] = -INFINITY;
+      } else {
+        any = true;
+      }
+    }
+    // end of text is allowed when the grammar is matched or nothing else is
+    if (eos < n_logits) {
+      logits[eos] = IsDone(stacks) || !any ? eos_logit : -INFINITY;
+    }
+  }
 
-    ctx_size += n_embd * n_vocab * ggml_type_sizef(wtype);  // lmh_g
-    ctx_size += n_vocab * ggml_type_sizef(GGML_TYPE_F32);   // lmh_b
+ private:
+  enum element_type { END, ALT, RULE, CHARS };
 
-    ctx_size += n_layer * (n_embd * ggml_type_sizef(GGML_TYPE_F32));  // ln_1_g
-    ctx_size += n_layer * (n_embd * ggml_type_sizef(GGML_TYPE_F32));  // ln_1_b
+  struct element {
+    element_type type;
+    int value;  // rule for RULE, character set for CHARS
+  };
 
-    ctx_size += n_layer *
-                (n_embd * n_embd * ggml_type_sizef(wtype));  // c_attn_q_proj_w
-    ctx_size += n_layer *
-                (n_embd * n_embd * ggml_type_sizef(wtype));  // c_attn_k_proj_w
-    ctx_size += n_layer *
-                (n_embd * n_embd * ggml_type_sizef(wtype));  // c_attn_v_proj_w
+  bool IsEnd(const int pos) const {
+    return elements_[pos].type == END || elements_[pos].type == ALT;
+  }
 
-    ctx_size +=
-        n_layer * (n_embd * n_embd * ggml_type_sizef(wtype));  // c_attn_proj_w
+  // Expands rule references at the top of the stack.
+  void Advance(const Stack &stack, Stacks &result) const {
+    if (stack.empty() || elements_[stack.back()].type == CHARS) {
+      if (std::find(result.begin(), result.end(), stack) == result.end()) {
+        result.push_back(stack);
+      }
+      return;
+    }
+    const int pos = stack.back();
+    for (const int alt : rule_alts_[elements_[pos].value]) {
+      Stack next(stack.begin(), stack.end() - 1);
+      if (!IsEnd(pos + 1)) {
+        next.push_back(pos + 1);
+      }
+      if (!IsEnd(alt)) {
+        next.push_back(alt);
+      }
+      Advance(next, result);
+    }
+  }
 
-    ctx_size +=
-        n_layer * (4 * n_embd * n_embd * ggml_type_sizef(wtype));  // c_mlp_fc_w
-    ctx_size +=
-        n_layer * (4 * n_embd * ggml_type_sizef(GGML_TYPE_F32));  // c_mlp_fc_b
+  void Mask(const GptjTokenTrie &trie, const int node, const Stacks &stacks,
+            std::vector<uint64_t> &mask) const {
+    for (const auto &child : trie.Get(node).children) {
+      const Stacks next = Accept(stacks, child.first);
+      if (next.empty()) {
+        continue;
+      }
+      for (const gpt_vocab::id id : trie.Get(child.second).tokens) {
+        mask[id / 64] |= (uint64_t)1 << (id % 64);
+      }
+      Mask(trie, child.second, next, mask);
+    }
+  }
 
-    ctx_size += n_layer *
-                (4 * n_embd * n_embd * ggml_type_sizef(wtype));  // c_mlp_proj_w
-    ctx_size +=
-        n_layer * (n_embd * ggml_type_sizef(GGML_TYPE_F32));  // c_mlp_proj_b
+  // Returns a rule that can be reached from itself without matching a
+  // character, or -1 if there is none.
+  int FindEmptyCycle() const {
+    // rules that can match the empty string
+    std::vector<bool> empty(rules_.size());
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (int r = 0; r < rules_.size(); r++) {
+        bool alt_empty = true;
+        for (const element &e : rules_[r]) {
+          if (e.type == ALT) {
+            if (alt_empty) {
+              break;
+            }
+            alt_empty = true;
+          } else {
+            alt_empty = alt_empty && e.type == RULE && empty[e.value];
+          }
+        }
+        if (alt_empty && !empty[r]) {
+          empty[r] = true;
+          changed = true;
+        }
+      }
+    }
 
-    ctx_size +=
-        n_ctx * n_layer * n_embd * ggml_type_sizef(GGML_TYPE_F16);  // memory_k
-    ctx_size +=
-        n_ctx * n_layer * n_embd * ggml_type_sizef(GGML_TYPE_F16);  // memory_v
+    // rules that can come first in each rule
+    std::vector<std::vector<int>> first(rules_.size());
+    for (int r = 0; r < rules_.size(); r++) {
+      bool prefix_empty = true;
+      for (const element &e : rules_[r]) {
+        if (e.type == ALT) {
+          prefix_empty = true;
+        } else if (prefix_empty) {
+          if (e.type == RULE) {
+            first[r].push_back(e.value);
+          }
+          prefix_empty = e.type == RULE && empty[e.value];
+        }
+      }
+    }
 
-    ctx_size += (5 + 10 * n_layer) * 256;  // object overhead
+    // depth first search for a cycle, 1 = on the path, 2 = done
+    std::vector<uint8_t> state(rules_.size());
+    std::vector<std::pair<int, int>> path;  // rule and next edge
+    for (int root = 0; root < rules_.size(); root++) {
+      if (state[root] != 0) {
+        continue;
+      }
+      state[root] = 1;
+      path.emplace_back(root, 0);
+      while (!path.empty()) {
+        auto &[r, edge] = path.back();
+        if (edge == first[r].size()) {
+          state[r] = 2;
+          path.pop_back();
+          continue;
+        }
+        const int next = first[r][edge++];
+        if (state[next] == 1) {
+          return next;
+        }
+        if (state[next] == 0) {
+          state[next] = 1;
+          path.emplace_back(next, 0);
+        }
+      }
+    }
+    return -1;
   }
 
-  // create the ggml context
-  {
-    struct ggml_init_params params = {
-        .mem_size = ctx_size,
-        .mem_buffer = NULL,
-        .no_alloc = false,
-    };
+  // parser
 
-    model.ctx = ggml_init(params);
-    if (!model.ctx) {
-      fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+  bool ParseRule() {
+    const std::string name = ParseName();
+    if (name.empty()) {
+      return false;
+    }
+    name_ = name;
+    ParseSpace(false);
+    if (strncmp(pos_, "::=", 3) != 0) {
+      return false;
+    }
+    pos_ += 3;
+    ParseSpace(true);
+    const int rule = RuleId(name);
+    std::vector<element> elements;
+    if (!ParseAlternatives(elements, false)) {
       return false;
     }
+    rules_[rule] = std::move(elements);
+    defined_.insert(rule);
+    return *pos_ == '\0' || *pos_ == '\n' || *pos_ == '\r';
   }
 
-  // prepare memory for the weights
-  {
-    const auto &hparams = model.hparams;
+  bool ParseAlternatives(std::vector<element> &out, const bool nested) {
+    if (!ParseSequence(out, nested)) {
+      return false;
+    }
+    while (*pos_ == '|') {
+      pos_++;
+      ParseSpace(true);
+      out.push_back({ALT, 0});
+      if (!ParseSequence(out, nested)) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-    const int n_embd = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx = hparams.n_ctx;
-    const int n_vocab = hparams.n_vocab;
+  bool ParseSequence(std::vector<element> &out, const bool nested) {
+    while (*pos_ && *pos_ != '|' && *pos_ != ')' && *pos_ != '\n' &&
+           *pos_ != '\r') {
+      const int start = out.size();
+      if (*pos_ == '"') {
+        pos_++;
+        while (*pos_ && *pos_ != '"') {
+          std::bitset<256> charset;
+          charset.set(ParseChar());
+          out.push_back({CHARS, AddCharset(charset)});
+        }
+        if (*pos_ != '"') {
+          return false;
+        }
+        pos_++;
+      } else if (*pos_ == '[') {
+        pos_++;
+        const bool negate = *pos_ == '^';
+        if (negate) {
+          pos_++;
+        }
+        std::bitset<256> charset;
+        while (*pos_ && *pos_ != ']') {
+          const uint8_t first = ParseChar();
+          uint8_t last = first;
+          if (pos_[0] == '-' && pos_[1] && pos_[1] != ']') {
+            pos_++;
+            last = ParseChar();
+          }
+          for (int c = first; c <= last; c++) {
+            charset.set(c);
+          }
+        }
+        if (*pos_ != ']') {
+          return false;
+        }
+        pos_++;
+        out.push_back({CHARS, AddCharset(negate ? ~charset : charset)});
+      } else if (*pos_ == '(') {
+        pos_++;
+        ParseSpace(true);
+        std::vector<element> group;
+        if (!ParseAlternatives(group, true) || *pos_ != ')') {
+          return false;
+        }
+        pos_++;
+        out.push_back({RULE, AddRule(std::move(group))});
+      } else {
+        const std::string name = ParseName();
+        if (name.empty()) {
+          return false;
+        }
+        out.push_back({RULE, RuleId(name)});
+      }
+      ParseSpace(nested);
+
+      // repetitions are rewritten as new rules
+      if (*pos_ == '*' || *pos_ == '+' || *pos_ == '?') {
+        const char op = *pos_++;
+        ParseSpace(nested);
+        const std::vector<element> item(out.begin() + start, out.end());
+        out.resize(start);
+        const int rule = AddRule({});
+        std::vector<element> &elements = rules_[rule];
+        elements = item;
+        if (op == '*' || op == '+') {
+          // rule ::= item rule | (empty or item)
+          elements.push_back({RULE, rule});
+        }
+        elements.push_back({ALT, 0});
+        if (op == '+') {
+          elements.insert(elements.end(), item.begin(), item.end());
+        }
+        out.push_back({RULE, rule});
+      }
+    }
+    return true;
+  }
 
-    model.layers.resize(n_layer);
+  std::string ParseName() {
+    const char *start = pos_;
+    while (isalnum((uint8_t)*pos_) || *pos_ == '-' || *pos_ == '_') {
+      pos_++;
+    }
+    return std::string(start, pos_);
+  }
 
-    model.wte = ggml_new_tensor_2d(ctx, wtype, n_embd, n_vocab);
+  uint8_t ParseChar() {
+    if (*pos_ != '\\') {
+      return *pos_++;
+    }
+    pos_++;
+    const char c = *pos_;
+    if (c == '\0') {
+      return 0;
+    }
+    pos_++;
+    switch (c) {
+      case 'n':
+        return '\n';
+      case 'r':
+        return '\r';
+      case 't':
+        return '\t';
+      case 'x': {
+        uint8_t value = 0;
+        for (int i = 0; i < 2 && isxdigit((uint8_t)*pos_); i++) {
+          const char d = tolower(*pos_++);
+          value = value * 16 + (isdigit((uint8_t)d) ? d - '0' : d - 'a' + 10);
+        }
+        return value;
+      }
+      default:
+        return c;
+    }
+  }
 
-    model.ln_f_g = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
-    model.ln_f_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+  // Skips spaces and comments, and newlines if allowed.
+  void ParseSpace(const bool newlines) {
+    while (*pos_) {
+      if (*pos_ == ' ' || *pos_ == '\t' ||
+          (newlines && (*pos_ == '\n' || *pos_ == '\r'))) {
+        pos_++;
+      } else if (*pos_ == '#') {
+        while (*pos_ && *pos_ != '\n' && *pos_ != '\r') {
+          pos_++;
+        }
+      } else if (!newlines && *pos_ == '\\' &&
+                 (pos_[1] == '\n' || pos_[1] == '\r')) {
+        pos_ += 2;
+      } else {
+        break;
+      }
+    }
+  }
 
-    model.lmh_g = ggml_new_tensor_2d(ctx, wtype, n_embd, n_vocab);
-    model.lmh_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_vocab);
+  int RuleId(const std::string &name) {
+    auto it = rule_ids_.find(name);
+    if (it != rule_ids_.end()) {
+      return it->second;
+    }
+    const int rule = AddRule({});
+    rule_ids_[name] = rule;
+    rule_names_[rule] = name;
+    return rule;
+  }
 
-    // map by name
-    model.tensors["transformer.wte.weight"] = model.wte;
+  // Groups and repetitions are named after the rule they are in.
+  int AddRule(std::vector<element> elements) {
+    rules_.push_back(std::move(elements));
+    rule_names_.push_back(name_);
+    return rules_.size() - 1;
+  }
 
-    model.tensors["transformer.ln_f.weight"] = model.ln_f_g;
-    model.tensors["transformer.ln_f.bias"] = model.ln_f_b;
+  int AddCharset(const std::bitset<256> &charset) {
+    for (int i = 0; i < charsets_.size(); i++) {
+      if (charsets_[i] == charset) {
+        return i;
+      }
+    }
+    charsets_.push_back(charset);
+    return charsets_.size() - 1;
+  }
 
-    model.tensors["lm_head.weight"] = model.lmh_g;
-    model.tensors["lm_head.bias"] = model.lmh_b;
+  const char *text_ = nullptr;
+  const char *pos_ = nullptr;
+  std::vector<std::vector<element>> rules_;
+  std::map<std::string, int> rule_ids_;
+  std::vector<std::string> rule_names_;
+  std::string name_;  // rule being parsed
+  std::unordered_set<int> defined_;
+
+  std::vector<element> elements_;
+  std::vector<std::vector<int>> rule_alts_;  // positions of alternatives
+  std::vector<std::bitset<256>> charsets_;
+  int start_ = 0;
+
+  // parse state -> tokens that can come next
+  std::unordered_map<std::string, std::vector<uint64_t>> masks_;
+};
 
-    for (int i = 0; i < n_layer; ++i) {
-      auto &layer = model.layers[i];
+/**
+ * Profiling
+ */
 
-      layer.ln_1_g = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
-      layer.ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+// Aggregates the time, estimated FLOPs and bytes of the named nodes of the
+// evaluated graphs. Nodes are named "l<layer>.<op>" inside a layer and "<op>"
+// outside of them. Unnamed nodes are counted as "other" in the layer of the
+// last named node. Node times are only recorded when ggml is built with
+// GGML_PERF.
+class GptjProfile {
+ public:
+  // Adds the nodes of a graph that was computed starting at t_start_us.
+  void Add(const ggml_cgraph &gf, const int64_t t_start_us) {
+    if (t_begin_us_ < 0) {
+      t_begin_us_ = t_start_us;
+    }
+    int64_t ts_us = t_start_us - t_begin_us_;
+    std::string prefix;
+    for (int i = 0; i < gf.n_nodes; i++) {
+      const ggml_tensor *node = gf.nodes[i];
+      if (node->op == GGML_OP_VIEW || node->op == GGML_OP_RESHAPE ||
+          node->op == GGML_OP_PERMUTE || node->op == GGML_OP_TRANSPOSE) {
+        continue;
+      }
 
-      layer.c_attn_q_proj_w = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
-      layer.c_attn_k_proj_w = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
-      layer.c_attn_v_proj_w = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+      std::string name = node->name;
+      if (name.empty()) {
+        name = prefix + "other";
+      } else {
+        const size_t dot = name.find('.');
+        prefix = dot == std::string::npos ? "" : name.substr(0, dot + 1);
+      }
 
-      layer.c_attn_proj_w = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+      auto it = index_.find(name);
+      if (it == index_.end()) {
+        it = index_.emplace(name, ops_.size()).first;
+        ops_.push_back({name});
+      }
+      op &o = ops_[it->second];
+      o.n_runs++;
+      o.time_us += node->perf_time_us;
+      o.flops += Flops(node);
+      o.bytes += Bytes(node);
+      has_times_ = has_times_ || node->perf_runs > 0;
+
+      events_.push_back({it->second, ts_us, node->perf_time_us});
+      ts_us += node->perf_time_us;
+    }
+  }
 
-      layer.c_mlp_fc_w = ggml_new_tensor_2d(ctx, wtype, n_embd, 4 * n_embd);
-      layer.c_mlp_fc_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4 * n_embd);
+  // Writes the totals of each op as JSON.
+  bool WriteJson(const std::string &fname) const {
+    FILE *f = OpenFile(fname);
+    if (f == nullptr) {
+      return false;
+    }
+    fprintf(f, "{\n  \"ops\": [");
+    for (int i = 0; i < ops_.size(); i++) {
+      const op &o = ops_[i];
+      fprintf(f,
+              "%s\n    {\"name\": \"%s\", \"runs\": %lld, \"time_us\": %lld, "
+              "\"flops\": %.0f, \"bytes\": %.0f}",
+              i == 0 ? "" : ",", o.name.c_str(), (long long)o.n_runs,
+              (long long)o.time_us, o.flops, o.bytes);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    return true;
+  }
 
-      layer.c_mlp_proj_w = ggml_new_tensor_2d(ctx, wtype, 4 * n_embd, n_embd);
-      layer.c_mlp_proj_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+  // Writes each node run as an event in the Chrome trace event format, which
+  // can be opened in chrome://tracing or Perfetto.
+  bool WriteTrace(const std::string &fname) const {
+    FILE *f = OpenFile(fname);
+    if (f == nullptr) {
+      return false;
+    }
+    fprintf(f, "{\"traceEvents\": [");
+    for (int i = 0; i < events_.size(); i++) {
+      const event &e = events_[i];
+      fprintf(f,
+              "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, "
+              "\"ts\": %lld, \"dur\": %lld}",
+              i == 0 ? "" : ",", ops_[e.op].name.c_str(), (long long)e.ts_us,
+              (long long)e.dur_us);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return true;
+  }
 
-      // map by name
-      model.tensors["transformer.h." + std::to_string(i) + ".ln_1.weight"] =
-          layer.ln_1_g;
-      model.tensors["transformer.h." + std::to_string(i) + ".ln_1.bias"] =
-          layer.ln_1_b;
+  void Clear() {
+    ops_.clear();
+    index_.clear();
+    events_.clear();
+    t_begin_us_ = -1;
+    has_times_ = false;
+  }
 
-      model.tensors["transformer.h." + std::to_string(i) +
-                    ".attn.q_proj.weight"] = layer.c_attn_q_proj_w;
-      model.tensors["transformer.h." + std::to_string(i) +
-                    ".attn.k_proj.weight"] = layer.c_attn_k_proj_w;
-      model.tensors["transformer.h." + std::to_string(i) +
-                    ".attn.v_proj.weight"] = layer.c_attn_v_proj_w;
+ private:
+  struct op {
+    std::string name;
+    int64_t n_runs = 0;
+    int64_t time_us = 0;
+    double flops = 0;
+    double bytes = 0;
+  };
 
-      model.tensors["transformer.h." + std::to_string(i) +
-                    ".attn.out_proj.weight"] = layer.c_attn_proj_w;
+  struct event {
+    int op;
+    int64_t ts_us;
+    int64_t dur_us;
+  };
 
-      model
-          .tensors["transformer.h." + std::to_string(i) + ".mlp.fc_in.weight"] =
-          layer.c_mlp_fc_w;
-      model.tensors["transformer.h." + std::to_string(i) + ".mlp.fc_in.bias"] =
-          layer.c_mlp_fc_b;
+  // Matrix multiplications are counted exactly and other ops as one operation
+  // per output element.
+  static double Flops(const ggml_tensor *node) {
+    if (node->op == GGML_OP_MUL_MAT) {
+      return 2.0 * node->src0->ne[0] * ggml_nelements(node);
+    }
+    return ggml_nelements(node);
+  }
 
-      model.tensors["transformer.h." + std::to_string(i) +
-                    ".mlp.fc_out.weight"] = layer.c_mlp_proj_w;
-      model.tensors["transformer.h." + std::to_string(i) + ".mlp.fc_out.bias"] =
-          layer.c_mlp_proj_b;
+  // Bytes read from the sources and written to the output.
+  static double Bytes(const ggml_tensor *node) {
+    double bytes = ggml_nbytes(node);
+    for (const ggml_tensor *src : {node->src0, node->src1}) {
+      if (src != nullptr) {
+        bytes += ggml_nbytes(src);
+      }
     }
+    return bytes;
   }
 
-  // key + value memory
+  FILE *OpenFile(const std::string &fname) const {
+    if (!has_times_) {
+      fprintf(stderr,
+              "%s: no node times were recorded, build ggml with GGML_PERF\n",
+              __func__);
+    }
+    FILE *f = fopen(fname.c_str(), "w");
+    if (f == nullptr) {
+      fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+    }
+    return f;
+  }
+
+  std::vector<op> ops_;
+  std::unordered_map<std::string, int> index_;
+  std::vector<event> events_;
+  int64_t t_begin_us_ = -1;
+  bool has_times_ = false;
+};
+
+// Alignment of the data of the tensors allocated by ggml, which the mapped
+// tensors must also have.
+#ifdef GGML_MEM_ALIGN
+#define GPTJ_MEM_ALIGN GGML_MEM_ALIGN
+#else
+#define GPTJ_MEM_ALIGN 16
+#endif
+
+// Maps the model file so that the weights of the layers are paged in while
+// evaluating instead of being loaded. Prefetch() asks the OS to read a layer
+// before it's used and Release() drops its pages after, so only a few layers
+// are resident at a time. Mapping is not supported on Windows.
+class GptjLayerPager {
+ public:
+  ~GptjLayerPager() {
+#ifndef _WIN32
+    if (addr_ != nullptr) {
+      munmap(addr_, size_);
+    }
+#endif
+  }
+
+  bool Map(const std::string &fname, const int n_layer) {
+#ifdef _WIN32
+    return false;
+#else
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    size_ = lseek(fd, 0, SEEK_END);
+    void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    addr_ = (char *)addr;
+    page_size_ = sysconf(_SC_PAGESIZE);
+    layers_.assign(n_layer, range());
+    return true;
+#endif
+  }
+
+  // Returns the data of a tensor of layer il, or nullptr if it's outside of
+  // the file.
+  char *AddTensor(const int il, const uint64_t offset, const uint64_t size) {
+    if (offset + size > size_) {
+      return nullptr;
+    }
+    range &r = layers_[il];
+    r.begin = std::min(r.begin, offset);
+    r.end = std::max(r.end, offset + size);
+    return addr_ + offset;
+  }
+
+  void Prefetch(const int il) const {
+#ifndef _WIN32
+    if (il < layers_.size() && layers_[il].begin < layers_[il].end) {
+      // rounded out to whole pages
+      const uint64_t begin = layers_[il].begin / page_size_ * page_size_;
+      const uint64_t end =
+          (layers_[il].end + page_size_ - 1) / page_size_ * page_size_;
+      madvise(addr_ + begin, std::min<uint64_t>(end, size_) - begin,
+              MADV_WILLNEED);
+    }
+#endif
+  }
+
+  void Release(const int il) const {
+#ifndef _WIN32
+    if (il < layers_.size()) {
+      // rounded in to whole pages to keep the pages of the next layer
+      const uint64_t begin =
+          (layers_[il].begin + page_size_ - 1) / page_size_ * page_size_;
+      const uint64_t end = layers_[il].end / page_size_ * page_size_;
+      if (begin < end) {
+        madvise(addr_ + begin, end - begin, MADV_DONTNEED);
+      }
+    }
+#endif
+  }
+
+ private:
+  struct range {
+    uint64_t begin = UINT64_MAX;
+    uint64_t end = 0;
+  };
+
+  char *addr_ = nullptr;
+  uint64_t size_ = 0;
+  uint64_t page_size_ = 4096;
+  std::vector<range> layers_;
+};
+
+// Memory for the weights and the key + value memory, which can be backed by
+// huge pages and interleaved over the NUMA nodes so that the threads on each
+// node read from local memory for part of each matrix. Only supported on
+// Linux.
+class GptjBuffer {
+ public:
+  ~GptjBuffer() {
+#ifdef __linux__
+    if (addr_ != nullptr) {
+      munmap(addr_, size_);
+    }
+#endif
+  }
+
+  // Allocates size bytes. huge_page_mb is the size of the huge pages (2 or
+  // 1024) or 0 to use normal pages. When there are no free huge pages,
+  // transparent huge pages are used instead.
+  bool Allocate(const size_t size, const int huge_page_mb,
+                const bool numa_interleave) {
+#ifdef __linux__
+    void *addr = MAP_FAILED;
+    if (huge_page_mb > 0) {
+      const size_t page_size = (size_t)huge_page_mb * 1024 * 1024;
+      const int page_shift = huge_page_mb == 1024 ? 30 : 21;
+      size_ = (size + page_size - 1) / page_size * page_size;
+      addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                      (page_shift << MAP_HUGE_SHIFT),
+                  -1, 0);
+      if (addr == MAP_FAILED) {
+        fprintf(stderr,
+                "%s: warning: no free %d MB huge pages, using transparent "
+                "huge pages\n",
+                __func__, huge_page_mb);
+      }
+    }
+    if (addr == MAP_FAILED) {
+      size_ = size;
+      addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (addr == MAP_FAILED) {
+        return false;
+      }
+      if (huge_page_mb > 0) {
+        madvise(addr, size_, MADV_HUGEPAGE);
+      }
+    }
+    addr_ = addr;
+
+    // the pages are placed when they are first written, which is after this
+    if (numa_interleave) {
+      unsigned long nodes[16] = {};
+      const int n_nodes = OnlineNodes(nodes, sizeof(nodes) * 8);
+      if (n_nodes > 1 &&
+          syscall(SYS_mbind, addr_, size_, GPTJ_MPOL_INTERLEAVE, nodes,
+                  sizeof(nodes) * 8, 0) != 0) {
+        fprintf(stderr, "%s: warning: failed to interleave memory\n",
+                __func__);
+      }
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void *Data() const { return addr_; }
+
+ private:
+  // Sets the bits of the online NUMA nodes and returns their number.
+  static int OnlineNodes(unsigned long *nodes, const int max_nodes) {
+    std::ifstream fin("/sys/devices/system/node/online");
+    const int bits = 8 * sizeof(*nodes);
+    std::string range;
+    int n_nodes = 0;
+    // a list of ranges such as "0-1,3"
+    while (std::getline(fin, range, ',')) {
+      int first = 0;
+      int last = 0;
+      const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+      if (n < 1) {
+        continue;
+      }
+      if (n == 1) {
+        last = first;
+      }
+      for (int node = first; node <= last && node < max_nodes; node++) {
+        nodes[node / bits] |= 1ul << (node % bits);
+        n_nodes++;
+      }
+    }
+    return n_nodes;
+  }
+
+  void *addr_ = nullptr;
+  size_t size_ = 0;
+};
+
+/**
+ * GPT-J
+ */
+
+// A part of a file to read into memory. If src_type differs from dst_type,
+// the data is converted from src_type (f32 or f16) to dst_type and written at
+// element start of the tensor at dst.
+struct gptj_read_chunk {
+  uint64_t offset;  // in the file
+  uint64_t size;    // in bytes in the file
+  char *dst;
+  ggml_type src_type;
+  ggml_type dst_type;
+  int64_t start = 0;
+};
+
+// Reads the chunks with n_threads threads that take the next chunk when they
+// are done. Large reads are split so that the threads share big tensors, and
+// each thread converts the parts that it reads.
+// Positioned reads are used so that the threads don't share a file position,
+// except on Windows, where each thread has its own stream.
+bool gptj_read_chunks(const std::string &fname,
+                      const std::vector<gptj_read_chunk> &chunks,
+                      const int n_threads) {
+  const uint64_t max_size = 32u * 1024 * 1024;
+  std::vector<gptj_read_chunk> parts;
+  for (const gptj_read_chunk &chunk : chunks) {
+    if (chunk.src_type == chunk.dst_type) {
+      for (uint64_t done = 0; done < chunk.size; done += max_size) {
+        parts.push_back({chunk.offset + done,
+                         std::min(max_size, chunk.size - done),
+                         chunk.dst + done, chunk.src_type, chunk.dst_type});
+      }
+      continue;
+    }
+    // converted parts have a whole number of quantization blocks
+    const size_t src_size = ggml_type_size(chunk.src_type);
+    const uint64_t n = chunk.size / src_size;
+    const uint64_t max_n = max_size / src_size / 256 * 256;
+    for (uint64_t done = 0; done < n; done += max_n) {
+      parts.push_back({chunk.offset + done * src_size,
+                       std::min(max_n, n - done) * src_size, chunk.dst,
+                       chunk.src_type, chunk.dst_type,
+                       chunk.start + (int64_t)done});
+    }
+  }
+
+#ifndef _WIN32
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+    return false;
+  }
+#endif
+
+  std::atomic<int> next(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+#ifdef _WIN32
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+      ok = false;
+      return;
+    }
+#endif
+    auto read = [&](char *dst, const uint64_t size, const uint64_t offset) {
+#ifdef _WIN32
+      fin.seekg(offset);
+      fin.read(dst, size);
+      return (bool)fin;
+#else
+      for (uint64_t done = 0; done < size;) {
+        const ssize_t n = pread(fd, dst + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          return false;
+        }
+        done += n;
+      }
+      return true;
+#endif
+    };
+
+    std::vector<char> buf;
+    std::vector<float> f32;
+    std::vector<int64_t> hist(1 << 4);
+    for (int i = next++; i < parts.size() && ok; i = next++) {
+      const gptj_read_chunk &part = parts[i];
+      if (part.src_type == part.dst_type) {
+        if (!read(part.dst, part.size, part.offset)) {
+          ok = false;
+        }
+        continue;
+      }
+
+      buf.resize(part.size);
+      if (!read(buf.data(), part.size, part.offset)) {
+        ok = false;
+        continue;
+      }
+      const int64_t n = part.size / ggml_type_size(part.src_type);
+      const float *src = (const float *)buf.data();
+      if (part.src_type == GGML_TYPE_F16) {
+        f32.resize(n);
+        const ggml_fp16_t *src_f16 = (const ggml_fp16_t *)buf.data();
+        for (int64_t j = 0; j < n; j++) {
+          f32[j] = ggml_fp16_to_fp32(src_f16[j]);
+        }
+        src = f32.data();
+      }
+      if (part.dst_type == GGML_TYPE_F32) {
+        memcpy((float *)part.dst + part.start, src, n * sizeof(float));
+      } else if (part.dst_type == GGML_TYPE_F16) {
+        ggml_fp16_t *dst = (ggml_fp16_t *)part.dst + part.start;
+        for (int64_t j = 0; j < n; j++) {
+          dst[j] = ggml_fp32_to_fp16(src[j]);
+        }
+      } else {
+        // src holds only this part, so it is quantized as a tensor of its own
+        // into the blocks from part.start on
+        char *dst = part.dst + part.start / ggml_blck_size(part.dst_type) *
+                                   ggml_type_size(part.dst_type);
+        ggml_quantize_chunk(part.dst_type, src, dst, 0, n, hist.data());
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 1; t < std::min<int>(n_threads, parts.size()); t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &w : workers) {
+    w.join();
+  }
+
+#ifndef _WIN32
+  close(fd);
+#endif
+  if (!ok) {
+    fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname.c_str());
+  }
+  return ok;
+}
+
+// load the model's weights from a file
+bool gptj_model_load(const std::string &fname, gptj_model &model,
+                     gpt_vocab &vocab, const gptj_load_params &params) {
+  auto fin = std::ifstream(fname, std::ios::binary);
+  if (!fin) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+    return false;
+  }
+
+  // verify magic
+  bool indexed = false;
+  uint32_t version = 0;
+  {
+    uint32_t magic;
+    fin.read((char *)&magic, sizeof(magic));
+    if (magic == GPTJ_FILE_MAGIC_INDEXED) {
+      indexed = true;
+      fin.read((char *)&version, sizeof(version));
+      if (version < GPTJ_FILE_VERSION_MIN || version > GPTJ_FILE_VERSION) {
+        fprintf(stderr, "%s: invalid model file '%s' (unsupported version %u)\n",
+                __func__, fname.c_str(), version);
+        return false;
+      }
+    } else if (magic != GPTJ_FILE_MAGIC) {
+      fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__,
+              fname.c_str());
+      return false;
+    }
+  }
+
+  // load hparams
+  {
+    auto &hparams = model.hparams;
+
+    fin.read((char *)&hparams.n_vocab, sizeof(hparams.n_vocab));
+    fin.read((char *)&hparams.n_ctx, sizeof(hparams.n_ctx));
+    fin.read((char *)&hparams.n_embd, sizeof(hparams.n_embd));
+    fin.read((char *)&hparams.n_head, sizeof(hparams.n_head));
+    fin.read((char *)&hparams.n_layer, sizeof(hparams.n_layer));
+    fin.read((char *)&hparams.n_rot, sizeof(hparams.n_rot));
+    fin.read((char *)&hparams.ftype, sizeof(hparams.ftype));
+
+    if (indexed) {
+      uint32_t alignment;
+      fin.read((char *)&alignment, sizeof(alignment));
+    }
+  }
+
+  // load vocab, which is read as is if it's prebuilt
+  {
+    const bool prebuilt = indexed && version >= GPTJ_FILE_VERSION_VOCAB;
+    if (!gptj_file_read_vocab(fin, prebuilt, model.hparams.n_vocab, vocab.pool,
+                              vocab.offsets, vocab.table)) {
+      fprintf(stderr,
+              "%s: invalid model file '%s' (bad vocab, expected %d tokens)\n",
+              __func__, fname.c_str(), model.hparams.n_vocab);
+      return false;
+    }
+  }
+
+  // for the big tensors, we have the option to store the data in 16-bit floats
+  // or quantized in order to save memory and also to speed up the computation
+  ggml_type wtype = ggml_ftype_to_ggml_type((ggml_ftype)(model.hparams.ftype));
+  if (wtype == GGML_TYPE_COUNT) {
+    fprintf(stderr, "%s: invalid model file '%s' (bad ftype value %d)\n",
+            __func__, fname.c_str(), model.hparams.ftype);
+    return false;
+  }
+
+  // the weights can be converted to another type while loading
+  ggml_type target_type = GGML_TYPE_COUNT;
+  if (params.wtype != nullptr && params.wtype[0] != '\0') {
+    target_type = gptj_type_from_name(params.wtype);
+    if (gptj_ftype_from_type(target_type) == GGML_FTYPE_UNKNOWN) {
+      fprintf(stderr, "%s: unsupported weight type '%s'\n", __func__,
+              params.wtype);
+      return false;
+    }
+    wtype = target_type;
+    model.hparams.ftype = gptj_ftype_from_type(target_type);
+  }
+
+  // the layers are mapped from the file as they are stored in it
+  bool lazy = params.lazy_layers;
+  if (lazy && target_type != GGML_TYPE_COUNT) {
+    fprintf(stderr,
+            "%s: the weights of lazily loaded layers can't be converted\n",
+            __func__);
+    return false;
+  }
+  if (lazy && !indexed) {
+    // the data of the tensors in the ggml format isn't aligned
+    fprintf(stderr,
+            "%s: warning: lazily loaded layers need the indexed format, see "
+            "gptj-convert, loading all the layers\n",
+            __func__);
+    lazy = false;
+  }
+  if (lazy) {
+    model.pager = new GptjLayerPager;
+    if (!model.pager->Map(fname, model.hparams.n_layer)) {
+      fprintf(stderr,
+              "%s: warning: failed to map '%s', loading all the layers\n",
+              __func__, fname.c_str());
+      delete model.pager;
+      model.pager = nullptr;
+      lazy = false;
+    }
+  }
+
+  // the tensor headers give the type of each tensor, which can differ between
+  // the weight matrices
+  std::vector<gptj_file_tensor> file_tensors;
+  if (!gptj_file_read_tensors(fin, indexed, file_tensors)) {
+    fprintf(stderr, "%s: invalid model file '%s' (bad tensor headers)\n",
+            __func__, fname.c_str());
+    return false;
+  }
+  std::map<std::string, ggml_type> file_types;
+  for (const auto &entry : file_tensors) {
+    file_types[entry.name] = (ggml_type)entry.ttype;
+  }
+
+  // the tensors of the model
+  struct tensor_spec {
+    std::string name;
+    int n_dims;
+    int32_t ne[2];
+    ggml_tensor **tensor;
+    int layer = -1;
+  };
+  std::vector<tensor_spec> specs;
+  {
+    const auto &hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_vocab = hparams.n_vocab;
+
+    model.layers.resize(n_layer);
+
+    specs.push_back(
+        {"transformer.wte.weight", 2, {n_embd, n_vocab}, &model.wte});
+
+    for (int i = 0; i < n_layer; ++i) {
+      auto &layer = model.layers[i];
+      const std::string prefix = "transformer.h." + std::to_string(i) + ".";
+
+      specs.push_back(
+          {prefix + "ln_1.weight", 1, {n_embd, 1}, &layer.ln_1_g, i});
+      specs.push_back(
+          {prefix + "ln_1.bias", 1, {n_embd, 1}, &layer.ln_1_b, i});
+
+      specs.push_back({prefix + "attn.q_proj.weight", 2, {n_embd, n_embd},
+                       &layer.c_attn_q_proj_w, i});
+      specs.push_back({prefix + "attn.k_proj.weight", 2, {n_embd, n_embd},
+                       &layer.c_attn_k_proj_w, i});
+      specs.push_back({prefix + "attn.v_proj.weight", 2, {n_embd, n_embd},
+                       &layer.c_attn_v_proj_w, i});
+
+      specs.push_back({prefix + "attn.out_proj.weight", 2, {n_embd, n_embd},
+                       &layer.c_attn_proj_w, i});
+
+      specs.push_back({prefix + "mlp.fc_in.weight", 2, {n_embd, 4 * n_embd},
+                       &layer.c_mlp_fc_w, i});
+      specs.push_back({prefix + "mlp.fc_in.bias", 1, {4 * n_embd, 1},
+                       &layer.c_mlp_fc_b, i});
+
+      specs.push_back({prefix + "mlp.fc_out.weight", 2, {4 * n_embd, n_embd},
+                       &layer.c_mlp_proj_w, i});
+      specs.push_back(
+          {prefix + "mlp.fc_out.bias", 1, {n_embd, 1}, &layer.c_mlp_proj_b, i});
+    }
+
+    specs.push_back({"transformer.ln_f.weight", 1, {n_embd, 1}, &model.ln_f_g});
+    specs.push_back({"transformer.ln_f.bias", 1, {n_embd, 1}, &model.ln_f_b});
+
+    specs.push_back({"lm_head.weight", 2, {n_embd, n_vocab}, &model.lmh_g});
+    specs.push_back({"lm_head.bias", 1, {n_vocab, 1}, &model.lmh_b});
+  }
+
+  // the vectors are f32 and the matrices have their type in the file, unless
+  // they are converted to the target type
+  auto tensor_type = [&](const tensor_spec &spec) {
+    if (spec.n_dims == 1) {
+      return GGML_TYPE_F32;
+    }
+    const auto it = file_types.find(spec.name);
+    if (it == file_types.end()) {
+      return wtype;
+    }
+    const ggml_type ttype = it->second;
+    if (target_type != GGML_TYPE_COUNT &&
+        (ttype == GGML_TYPE_F32 || ttype == GGML_TYPE_F16) &&
+        spec.ne[0] % ggml_blck_size(target_type) == 0) {
+      return target_type;
+    }
+    return ttype;
+  };
+
+  auto &ctx = model.ctx;
+
+  size_t ctx_size = 0;
+
+  {
+    const auto &hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx = hparams.n_ctx;
+
+    for (const auto &spec : specs) {
+      if (!lazy || spec.layer < 0) {
+        ctx_size += gptj_file_tensor_size(tensor_type(spec), spec.ne);
+      }
+    }
+
+    ctx_size +=
+        n_ctx * n_layer * n_embd * ggml_type_sizef(GGML_TYPE_F16);  // memory_k
+    ctx_size +=
+        n_ctx * n_layer * n_embd * ggml_type_sizef(GGML_TYPE_F16);  // memory_v
+
+    ctx_size += (5 + 10 * n_layer) * 256;  // object overhead
+  }
+
+  // allocate the memory of the ggml context with huge pages or interleaved
+  if (params.huge_page_mb != 0 && params.huge_page_mb != 2 &&
+      params.huge_page_mb != 1024) {
+    fprintf(stderr, "%s: unsupported huge page size %d MB\n", __func__,
+            params.huge_page_mb);
+    return false;
+  }
+  if (params.huge_page_mb > 0 || params.numa_interleave) {
+    model.buffer = new GptjBuffer;
+    if (!model.buffer->Allocate(ctx_size, params.huge_page_mb,
+                                params.numa_interleave)) {
+      fprintf(stderr,
+              "%s: warning: huge pages and NUMA interleaving are only "
+              "supported on Linux\n",
+              __func__);
+      delete model.buffer;
+      model.buffer = nullptr;
+    }
+  }
+
+  // create the ggml context
+  {
+    struct ggml_init_params params = {
+        .mem_size = ctx_size,
+        .mem_buffer = model.buffer != nullptr ? model.buffer->Data() : NULL,
+        .no_alloc = false,
+    };
+
+    model.ctx = ggml_init(params);
+    if (!model.ctx) {
+      fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+      return false;
+    }
+
+    // the data of the lazily loaded tensors is in the mapped file
+    if (lazy) {
+      struct ggml_init_params params = {
+          .mem_size = (size_t)model.hparams.n_layer * 10 * 512,
+          .mem_buffer = NULL,
+          .no_alloc = true,
+      };
+
+      model.ctx_layers = ggml_init(params);
+      if (!model.ctx_layers) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return false;
+      }
+    }
+  }
+
+  // prepare memory for the weights
+  std::map<std::string, int> lazy_layers;
+  for (const auto &spec : specs) {
+    struct ggml_context *spec_ctx = ctx;
+    if (lazy && spec.layer >= 0) {
+      spec_ctx = model.ctx_layers;
+      lazy_layers[spec.name] = spec.layer;
+    }
+    if (spec.n_dims == 1) {
+      *spec.tensor = ggml_new_tensor_1d(spec_ctx, GGML_TYPE_F32, spec.ne[0]);
+    } else {
+      *spec.tensor = ggml_new_tensor_2d(spec_ctx, tensor_type(spec), spec.ne[0],
+                                        spec.ne[1]);
+    }
+
+    // map by name
+    model.tensors[spec.name] = *spec.tensor;
+  }
+
+  // key + value memory
   {
     const auto &hparams = model.hparams;
 
@@ -492,40 +1654,30 @@ bool gptj_model_load(const std::string &fname, gptj_model &model,
     int n_tensors = 0;
     size_t total_size = 0;
 
-    while (true) {
-      int32_t n_dims;
-      int32_t length;
-      int32_t ttype;
-
-      fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-      fin.read(reinterpret_cast<char *>(&length), sizeof(length));
-      fin.read(reinterpret_cast<char *>(&ttype), sizeof(ttype));
-
-      if (fin.eof()) {
-        break;
-      }
+    // the data is read in parallel after the tensor headers
+    std::vector<gptj_read_chunk> chunks;
 
-      int32_t nelements = 1;
-      int32_t ne[2] = {1, 1};
-      for (int i = 0; i < n_dims; ++i) {
-        fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-        nelements *= ne[i];
+    // returns the model tensor that the tensor in the file is loaded into
+    auto find_tensor = [&](const std::string &name, const int32_t ne[2],
+                           const int32_t ttype) -> ggml_tensor * {
+      if (!gptj_file_valid_type(ttype)) {
+        fprintf(stderr, "%s: tensor '%s' has invalid type %d in model file\n",
+                __func__, name.data(), ttype);
+        return nullptr;
       }
 
-      std::string name(length, 0);
-      fin.read(&name[0], length);
-
       if (model.tensors.find(name.data()) == model.tensors.end()) {
         fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__,
                 name.data());
-        return false;
+        return nullptr;
       }
 
+      const int32_t nelements = ne[0] * ne[1];
       auto tensor = model.tensors[name.data()];
       if (ggml_nelements(tensor) != nelements) {
         fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n",
                 __func__, name.data());
-        return false;
+        return nullptr;
       }
 
       if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1]) {
@@ -534,7 +1686,21 @@ bool gptj_model_load(const std::string &fname, gptj_model &model,
                 "expected [%d, %d]\n",
                 __func__, name.data(), (int)tensor->ne[0], (int)tensor->ne[1],
                 ne[0], ne[1]);
-        return false;
+        return nullptr;
+      }
+
+      if (ttype != tensor->type) {
+        // only f32 and f16 weights can be converted
+        if ((ttype == GGML_TYPE_F32 || ttype == GGML_TYPE_F16) &&
+            tensor->ne[0] % ggml_blck_size(tensor->type) == 0) {
+          return tensor;
+        }
+        fprintf(stderr,
+                "%s: tensor '%s' has type %s in model file, which cannot be "
+                "converted to %s\n",
+                __func__, name.data(), ggml_type_name(ggml_type(ttype)),
+                ggml_type_name(tensor->type));
+        return nullptr;
       }
 
       const size_t bpe = ggml_type_size(ggml_type(ttype));
@@ -545,12 +1711,64 @@ bool gptj_model_load(const std::string &fname, gptj_model &model,
                 "%s: tensor '%s' has wrong size in model file: got %zu, "
                 "expected %zu\n",
                 __func__, name.data(), ggml_nbytes(tensor), nelements * bpe);
+        return nullptr;
+      }
+
+      return tensor;
+    };
+
+    for (const auto &entry : file_tensors) {
+      auto tensor = find_tensor(entry.name, entry.ne, entry.ttype);
+      if (tensor == nullptr) {
         return false;
       }
+      if (entry.size != gptj_file_tensor_size(entry.ttype, entry.ne)) {
+        fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n",
+                __func__, entry.name.c_str());
+        return false;
+      }
+
+      const auto lazy_layer = lazy_layers.find(entry.name);
+      if (lazy_layer != lazy_layers.end()) {
+        if (entry.ttype != tensor->type) {
+          fprintf(stderr,
+                  "%s: tensor '%s' is %s in model file, which can't be loaded "
+                  "lazily as %s\n",
+                  __func__, entry.name.c_str(),
+                  ggml_type_name(ggml_type(entry.ttype)),
+                  ggml_type_name(tensor->type));
+          return false;
+        }
+        if (entry.offset % GPTJ_MEM_ALIGN != 0) {
+          fprintf(stderr,
+                  "%s: tensor '%s' isn't aligned to %d bytes in model file, "
+                  "convert it with a larger --align to load it lazily\n",
+                  __func__, entry.name.c_str(), GPTJ_MEM_ALIGN);
+          return false;
+        }
+        tensor->data = model.pager->AddTensor(lazy_layer->second,
+                                              entry.offset, entry.size);
+        if (tensor->data == nullptr) {
+          fprintf(stderr, "%s: tensor '%s' is outside of the model file\n",
+                  __func__, entry.name.c_str());
+          return false;
+        }
+      } else {
+        chunks.push_back({entry.offset, entry.size, (char *)tensor->data,
+                          (ggml_type)entry.ttype, tensor->type});
+      }
 
-      fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
-
       total_size += ggml_nbytes(tensor);
+      n_tensors++;
+    }
+
+    const int n_threads =
+        params.n_threads > 0
+            ? params.n_threads
+            : std::max(1,
+                       std::min(8, (int)std::thread::hardware_concurrency()));
+    if (!gptj_read_chunks(fname, chunks, n_threads)) {
+      return false;
     }
   }
 
@@ -559,20 +1777,85 @@ bool gptj_model_load(const std::string &fname, gptj_model &model,
   return true;
 }
 
-// evaluate the transformer
+void gptj_model_free(gptj_model &model) {
+  ggml_free(model.ctx);
+  if (model.ctx_layers != nullptr) {
+    ggml_free(model.ctx_layers);
+  }
+  delete model.pager;
+  delete model.buffer;
+}
+
+// a batch of tokens to evaluate together
 //
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted logits for the next token
+// The tokens are split into segments of consecutive positions in a sequence and
+// each segment is stored in consecutive memory cells. Sequences can share the
+// cells of a common prefix, in which case the mask selects the cells that each
+// token attends to. Without a mask, the batch must be a single segment stored
+// right after the previous tokens, which it attends to.
+//
+struct gptj_batch {
+  struct segment {
+    int n_tokens;
+    int pos;   // position of the first token
+    int cell;  // memory cell of the first token
+  };
+
+  std::vector<gpt_vocab::id> tokens;
+  std::vector<segment> segments;
+
+  // number of memory cells to attend to
+  int n_kv = 0;
+  // [n_kv, n_tokens] mask which is -INFINITY where a token can't attend to a
+  // cell and 0 otherwise
+  std::vector<float> mask;
+
+  // return the hidden states after this layer instead of the logits, where
+  // n_layer returns the final normalized hidden states (-1 = return logits)
+  int embd_layer = -1;
+};
+
+// Builds a batch with one token of each sequence, which is stored in the last
+// cell of the sequence and attends to the first n_prefix cells and to the
+// cells of its sequence.
+gptj_batch gptj_make_sequences_batch(
+    const int n_prefix, const std::vector<gpt_vocab::id> &tokens,
+    const std::vector<const std::vector<int> *> &cells) {
+  gptj_batch batch;
+  batch.tokens = tokens;
+  for (const std::vector<int> *seq_cells : cells) {
+    batch.segments.push_back(
+        {1, n_prefix + (int)seq_cells->size() - 1, seq_cells->back()});
+    batch.n_kv = std::max(batch.n_kv, seq_cells->back() + 1);
+  }
+
+  batch.mask.assign((size_t)batch.n_kv * tokens.size(), -INFINITY);
+  for (int i = 0; i < tokens.size(); i++) {
+    float *row = batch.mask.data() + (size_t)i * batch.n_kv;
+    std::fill(row, row + n_prefix, 0.0f);
+    for (const int cell : *cells[i]) {
+      row[cell] = 0.0f;
+    }
+  }
+  return batch;
+}
+
+// evaluate the transformer on a batch
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - batch:      the tokens and where to store them in memory
+//   - embd_w:     the predicted logits for the next token, or the hidden
+//                 states if batch.embd_layer is set
+//   - logits_all: return the logits for every token instead of just the last
 //
 // The GPT-J model requires about 16MB of memory per input token.
 //
-bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
-               const std::vector<gpt_vocab::id> &embd_inp,
-               std::vector<float> &embd_w, size_t &mem_per_token) {
-  const int N = embd_inp.size();
+bool gptj_eval_batch(const gptj_model &model, const int n_threads,
+                     const gptj_batch &batch, std::vector<float> &embd_w,
+                     size_t &mem_per_token, const bool logits_all) {
+  const int N = batch.tokens.size();
+  const int n_kv = batch.n_kv;
 
   const auto &hparams = model.hparams;
 
@@ -588,10 +1871,17 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
   static size_t buf_size = 256u * 1024 * 1024;
   static void *buf = malloc(buf_size);
 
-  if (mem_per_token > 0 && mem_per_token * N > buf_size) {
+  // mem_per_token is measured without a mask, and the mask is repeated for
+  // each head in each layer
+  const size_t mask_size =
+      batch.mask.empty()
+          ? 0
+          : ((size_t)n_layer * n_head + 1) * n_kv * N * sizeof(float);
+
+  if (mem_per_token > 0 && mem_per_token * N + mask_size > buf_size) {
     const size_t buf_size_new =
-        1.1 *
-        (mem_per_token * N);  // add 10% to account for ggml object overhead
+        1.1 * (mem_per_token * N +
+               mask_size);  // add 10% to account for ggml object overhead
 
     // reallocate
     buf_size = buf_size_new;
@@ -611,18 +1901,67 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
   struct ggml_context *ctx0 = ggml_init(params);
   struct ggml_cgraph gf = {.n_threads = n_threads};
 
+  // names a node for profiling, prefixed by its layer if il >= 0
+  auto name = [&](struct ggml_tensor *cur, const int il, const char *op) {
+    if (model.profile != nullptr) {
+      char buf[GGML_MAX_NAME];
+      if (il >= 0) {
+        snprintf(buf, sizeof(buf), "l%d.%s", il, op);
+      } else {
+        snprintf(buf, sizeof(buf), "%s", op);
+      }
+      ggml_set_name(cur, buf);
+    }
+    return cur;
+  };
+
   struct ggml_tensor *embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-  memcpy(embd->data, embd_inp.data(), N * ggml_element_size(embd));
+  memcpy(embd->data, batch.tokens.data(), N * ggml_element_size(embd));
+
+  struct ggml_tensor *KQ_mask = nullptr;
+  if (!batch.mask.empty()) {
+    KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N);
+    memcpy(KQ_mask->data, batch.mask.data(), ggml_nbytes(KQ_mask));
+  }
+
+  // the layers after the requested hidden states are not evaluated
+  const int n_eval_layer = batch.embd_layer < 0
+                               ? n_layer
+                               : std::min(batch.embd_layer + 1, n_layer);
+  const int n_out = batch.embd_layer < 0 ? n_vocab : n_embd;
+
+  // computes the graph built so far and starts a new one
+  auto compute = [&](struct ggml_tensor *out) {
+    ggml_build_forward_expand(&gf, out);
+    const int64_t t_start_us = ggml_time_us();
+    ggml_graph_compute(ctx0, &gf);
+    if (model.profile != nullptr) {
+      model.profile->Add(gf, t_start_us);
+    }
+    gf = {.n_threads = n_threads};
+  };
+
+  // lazily loaded layers are computed one at a time, while the next layer is
+  // paged in
+  const GptjLayerPager *pager = model.pager;
+  if (pager != nullptr) {
+    pager->Prefetch(0);
+  }
 
   // wte
-  struct ggml_tensor *inpL = ggml_get_rows(ctx0, model.wte, embd);
+  struct ggml_tensor *inpL =
+      name(ggml_get_rows(ctx0, model.wte, embd), -1, "wte");
 
-  for (int il = 0; il < n_layer; ++il) {
+  for (int il = 0; il < n_eval_layer; ++il) {
     struct ggml_tensor *cur;
 
+    if (pager != nullptr) {
+      pager->Prefetch(il + 1);
+    }
+
     // norm
     {
-      cur = ggml_norm(ctx0, inpL);
+      cur = name(ggml_norm(ctx0, inpL), il, "ln_1");
 
       // cur = ln_1_g*cur + ln_1_b
       cur = ggml_add(
@@ -635,55 +1974,94 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
 
     // self-attention
     {
-      struct ggml_tensor *Qcur = ggml_rope(
+      struct ggml_tensor *Qcur = ggml_reshape_3d(
           ctx0,
-          ggml_reshape_3d(
-              ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_q_proj_w, cur),
-              n_embd / n_head, n_head, N),
-          n_past, n_rot, 0);
-      struct ggml_tensor *Kcur = ggml_rope(
+          name(ggml_mul_mat(ctx0, model.layers[il].c_attn_q_proj_w, cur), il,
+               "q"),
+          d_key, n_head, N);
+      struct ggml_tensor *Kcur = ggml_reshape_3d(
           ctx0,
-          ggml_reshape_3d(
-              ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_k_proj_w, cur),
-              n_embd / n_head, n_head, N),
-          n_past, n_rot, 0);
-
-      // store key and value to memory
-      {
-        struct ggml_tensor *Vcur = ggml_transpose(
-            ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_v_proj_w, cur));
+          name(ggml_mul_mat(ctx0, model.layers[il].c_attn_k_proj_w, cur), il,
+               "k"),
+          d_key, n_head, N);
+      struct ggml_tensor *Vcur = name(
+          ggml_mul_mat(ctx0, model.layers[il].c_attn_v_proj_w, cur), il, "v");
+
+      // rotate each segment by its positions
+      struct ggml_tensor *Qrot =
+          batch.segments.size() == 1
+              ? nullptr
+              : ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, d_key, n_head, N);
+
+      int offset = 0;
+      for (const auto &seg : batch.segments) {
+        struct ggml_tensor *Qseg = name(
+            ggml_rope(ctx0,
+                      ggml_view_3d(ctx0, Qcur, d_key, n_head, seg.n_tokens,
+                                   Qcur->nb[1], Qcur->nb[2],
+                                   offset * Qcur->nb[2]),
+                      seg.pos, n_rot, 0),
+            il, "q_rope");
+        struct ggml_tensor *Kseg = name(
+            ggml_rope(ctx0,
+                      ggml_view_3d(ctx0, Kcur, d_key, n_head, seg.n_tokens,
+                                   Kcur->nb[1], Kcur->nb[2],
+                                   offset * Kcur->nb[2]),
+                      seg.pos, n_rot, 0),
+            il, "k_rope");
+
+        if (Qrot == nullptr) {
+          Qrot = Qseg;
+        } else {
+          ggml_build_forward_expand(
+              &gf, ggml_cpy(ctx0, Qseg,
+                            ggml_view_3d(ctx0, Qrot, d_key, n_head,
+                                         seg.n_tokens, Qrot->nb[1], Qrot->nb[2],
+                                         offset * Qrot->nb[2])));
+        }
 
-        struct ggml_tensor *k =
-            ggml_view_1d(ctx0, model.memory_k, N * n_embd,
-                         (ggml_element_size(model.memory_k) * n_embd) *
-                             (il * n_ctx + n_past));
-        struct ggml_tensor *v = ggml_view_2d(
-            ctx0, model.memory_v, N, n_embd,
-            (n_ctx)*ggml_element_size(model.memory_v),
-            (il * n_ctx) * ggml_element_size(model.memory_v) * n_embd +
-                n_past * ggml_element_size(model.memory_v));
+        // store key and value to memory
+        {
+          struct ggml_tensor *Vseg = ggml_transpose(
+              ctx0, ggml_view_2d(ctx0, Vcur, n_embd, seg.n_tokens, Vcur->nb[1],
+                                 offset * Vcur->nb[1]));
+
+          struct ggml_tensor *k =
+              ggml_view_1d(ctx0, model.memory_k, seg.n_tokens * n_embd,
+                           (ggml_element_size(model.memory_k) * n_embd) *
+                               (il * n_ctx + seg.cell));
+          struct ggml_tensor *v = ggml_view_2d(
+              ctx0, model.memory_v, seg.n_tokens, n_embd,
+              (n_ctx)*ggml_element_size(model.memory_v),
+              (il * n_ctx) * ggml_element_size(model.memory_v) * n_embd +
+                  seg.cell * ggml_element_size(model.memory_v));
+
+          ggml_build_forward_expand(
+              &gf, name(ggml_cpy(ctx0, Kseg, k), il, "k_store"));
+          ggml_build_forward_expand(
+              &gf, name(ggml_cpy(ctx0, Vseg, v), il, "v_store"));
+        }
 
-        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+        offset += seg.n_tokens;
       }
 
       // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1,
       // 3)
-      struct ggml_tensor *Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
+      struct ggml_tensor *Q = ggml_permute(ctx0, Qrot, 0, 2, 1, 3);
 
-      // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+      // K = Kmem.view(n_embd/n_head, n_head, n_kv).permute(0, 2, 1, 3)
       struct ggml_tensor *K = ggml_permute(
           ctx0,
           ggml_reshape_3d(
               ctx0,
               ggml_view_1d(
-                  ctx0, model.memory_k, (n_past + N) * n_embd,
+                  ctx0, model.memory_k, n_kv * n_embd,
                   il * n_ctx * ggml_element_size(model.memory_k) * n_embd),
-              n_embd / n_head, n_head, n_past + N),
+              n_embd / n_head, n_head, n_kv),
           0, 2, 1, 3);
 
       // K * Q
-      struct ggml_tensor *KQ = ggml_mul_mat(ctx0, K, Q);
+      struct ggml_tensor *KQ = name(ggml_mul_mat(ctx0, K, Q), il, "kq");
 
       // KQ_scaled = KQ / sqrt(n_embd/n_head)
       struct ggml_tensor *KQ_scaled = ggml_scale(
@@ -691,21 +2069,24 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
 
       // KQ_masked = mask_past(KQ_scaled)
       struct ggml_tensor *KQ_masked =
-          ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+          KQ_mask == nullptr
+              ? ggml_diag_mask_inf(ctx0, KQ_scaled, n_kv - N)
+              : ggml_add(ctx0, KQ_scaled, ggml_repeat(ctx0, KQ_mask, KQ_scaled));
 
       // KQ = soft_max(KQ_masked)
-      struct ggml_tensor *KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+      struct ggml_tensor *KQ_soft_max =
+          name(ggml_soft_max(ctx0, KQ_masked), il, "kq_soft_max");
 
-      // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0,
+      // V_trans = Vmem.view(n_embd/n_head, n_head, n_kv).permute(1, 2, 0,
       // 3).contiguous()
       struct ggml_tensor *V = ggml_view_3d(
-          ctx0, model.memory_v, n_past + N, n_embd / n_head, n_head,
+          ctx0, model.memory_v, n_kv, n_embd / n_head, n_head,
           n_ctx * ggml_element_size(model.memory_v),
           n_ctx * ggml_element_size(model.memory_v) * n_embd / n_head,
           il * n_ctx * ggml_element_size(model.memory_v) * n_embd);
-
       // KQV = transpose(V) * KQ_soft_max
-      struct ggml_tensor *KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+      struct ggml_tensor *KQV =
+          name(ggml_mul_mat(ctx0, V, KQ_soft_max), il, "kqv");
 
       // KQV_merged = KQV.permute(0, 2, 1, 3)
       struct ggml_tensor *KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
@@ -715,7 +2096,8 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
                      ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
 
       // projection (no bias)
-      cur = ggml_mul_mat(ctx0, model.layers[il].c_attn_proj_w, cur);
+      cur = name(ggml_mul_mat(ctx0, model.layers[il].c_attn_proj_w, cur), il,
+                 "attn_proj");
     }
 
     struct ggml_tensor *inpFF = cur;
@@ -725,17 +2107,19 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
     // parallel to the self-attention
     {
       // note here we pass inpSA instead of cur
-      cur = ggml_mul_mat(ctx0, model.layers[il].c_mlp_fc_w, inpSA);
+      cur = name(ggml_mul_mat(ctx0, model.layers[il].c_mlp_fc_w, inpSA), il,
+                 "mlp_fc");
 
       cur = ggml_add(ctx0, ggml_repeat(ctx0, model.layers[il].c_mlp_fc_b, cur),
                      cur);
 
       // GELU activation
-      cur = ggml_gelu(ctx0, cur);
+      cur = name(ggml_gelu(ctx0, cur), il, "mlp_gelu");
 
       // projection
       // cur = proj_w*cur + proj_b
-      cur = ggml_mul_mat(ctx0, model.layers[il].c_mlp_proj_w, cur);
+      cur = name(ggml_mul_mat(ctx0, model.layers[il].c_mlp_proj_w, cur), il,
+                 "mlp_proj");
 
       cur = ggml_add(
           ctx0, ggml_repeat(ctx0, model.layers[il].c_mlp_proj_b, cur), cur);
@@ -746,11 +2130,22 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
 
     // input for next layer
     inpL = ggml_add(ctx0, cur, inpL);
+
+    if (pager != nullptr) {
+      compute(inpL);
+      pager->Release(il);
+
+      // the next graph starts from a copy of the output, so that it doesn't
+      // compute this layer again
+      struct ggml_tensor *out = inpL;
+      inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+      memcpy(inpL->data, out->data, ggml_nbytes(inpL));
+    }
   }
 
   // norm
-  {
-    inpL = ggml_norm(ctx0, inpL);
+  if (batch.embd_layer < 0 || batch.embd_layer >= n_layer) {
+    inpL = name(ggml_norm(ctx0, inpL), -1, "ln_f");
 
     // inpL = ln_f_g*inpL + ln_f_b
     inpL = ggml_add(ctx0,
@@ -759,8 +2154,8 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
   }
 
   // lm_head
-  {
-    inpL = ggml_mul_mat(ctx0, model.lmh_g, inpL);
+  if (batch.embd_layer < 0) {
+    inpL = name(ggml_mul_mat(ctx0, model.lmh_g, inpL), -1, "lm_head");
 
     inpL = ggml_add(ctx0, ggml_repeat(ctx0, model.lmh_b, inpL), inpL);
   }
@@ -769,24 +2164,28 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
   // inpL = ggml_soft_max(ctx0, inpL);
 
   // run the computation
-  ggml_build_forward_expand(&gf, inpL);
-  ggml_graph_compute(ctx0, &gf);
+  compute(inpL);
 
   // if (n_past%100 == 0) {
   //     ggml_graph_print   (&gf);
   //     ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
   // }
 
-  // embd_w.resize(n_vocab*N);
-  // memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-
-  // return result for just the last token
-  embd_w.resize(n_vocab);
-  memcpy(embd_w.data(), (float *)ggml_get_data(inpL) + (n_vocab * (N - 1)),
-         sizeof(float) * n_vocab);
+  if (logits_all) {
+    // return result for all tokens
+    embd_w.resize(n_out * N);
+    memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float) * n_out * N);
+  } else {
+    // return result for just the last token
+    embd_w.resize(n_out);
+    memcpy(embd_w.data(), (float *)ggml_get_data(inpL) + (n_out * (N - 1)),
+           sizeof(float) * n_out);
+  }
 
-  if (mem_per_token == 0) {
-    mem_per_token = ggml_used_mem(ctx0) / N;
+  // only the full model is used to estimate the memory per token, without
+  // the mask that is added to the estimate of each masked batch
+  if (mem_per_token == 0 && batch.embd_layer < 0) {
+    mem_per_token = (ggml_used_mem(ctx0) - mask_size) / N;
   }
 
   ggml_free(ctx0);
@@ -794,52 +2193,459 @@ bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
   return true;
 }
 
-// https://github.com/marella/train/blob/3c4ba1f59bf20e31f7ee5ea9a8f38e49440a93f7/train/state.py#L135-L175
-class GptjRingBuffer {
+// evaluate the transformer
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - n_past:    the context size so far
+//   - embd_inp:  the embeddings of the tokens in the context
+//   - embd_w:    the predicted logits for the next token
+//   - logits_all: return the logits for every token instead of just the last
+//
+bool gptj_eval(const gptj_model &model, const int n_threads, const int n_past,
+               const std::vector<gpt_vocab::id> &embd_inp,
+               std::vector<float> &embd_w, size_t &mem_per_token,
+               const bool logits_all) {
+  gptj_batch batch;
+  batch.tokens = embd_inp;
+  batch.segments.push_back({(int)embd_inp.size(), n_past, n_past});
+  batch.n_kv = n_past + embd_inp.size();
+  return gptj_eval_batch(model, n_threads, batch, embd_w, mem_per_token,
+                         logits_all);
+}
+
+// evaluate sequences of tokens that don't depend on each other
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - n_batch:    max number of tokens per batch
+//   - n_shared:   the number of tokens in memory that every token attends to
+//   - first_cell: the memory cell of the first token of the sequences
+//   - embd_layer: the layer to return the hidden states of (-1 = logits)
+//   - sequences:  the tokens of each sequence
+//   - fn:         called with the output of each token, its sequence and its
+//                 position in the sequence
+//
+// The sequences are packed into batches and stored in memory from first_cell,
+// starting over at first_cell when the memory is full, so each one has to fit
+// in the cells after it. Each token attends to the shared tokens and to the
+// tokens before it in its sequence, and the positions of the tokens start
+// after the shared tokens.
+//
+bool gptj_eval_sequences(
+    const gptj_model &model, const int n_threads, const int n_batch,
+    const int n_shared, const int first_cell, const int embd_layer,
+    const std::vector<std::vector<gpt_vocab::id>> &sequences,
+    size_t &mem_per_token,
+    const std::function<void(const float *out, int seq, int pos)> &fn) {
+  const int n_ctx = model.hparams.n_ctx;
+  const int n_out =
+      embd_layer < 0 ? model.hparams.n_vocab : model.hparams.n_embd;
+  const int n_free = n_ctx - first_cell;
+
+  struct token_info {
+    int seq;
+    int pos;
+    int first_cell;  // memory cell of the first token of the sequence
+  };
+  gptj_batch batch;
+  batch.embd_layer = embd_layer;
+  std::vector<token_info> infos;
+  std::vector<float> out;
+
+  auto flush = [&]() {
+    if (batch.tokens.empty()) {
+      return true;
+    }
+
+    batch.mask.assign((size_t)batch.n_kv * infos.size(), -INFINITY);
+    for (int i = 0; i < infos.size(); i++) {
+      float *row = batch.mask.data() + (size_t)i * batch.n_kv;
+      std::fill(row, row + n_shared, 0.0f);
+      std::fill(row + infos[i].first_cell,
+                row + infos[i].first_cell + infos[i].pos + 1, 0.0f);
+    }
+
+    if (!gptj_eval_batch(model, n_threads, batch, out, mem_per_token, true)) {
+      fprintf(stderr, "%s: failed to predict\n", __func__);
+      return false;
+    }
+    for (int i = 0; i < infos.size(); i++) {
+      fn(out.data() + (size_t)i * n_out, infos[i].seq, infos[i].pos);
+    }
+
+    batch.tokens.clear();
+    batch.segments.clear();
+    batch.n_kv = 0;
+    infos.clear();
+    return true;
+  };
+
+  int n_used = 0;  // free cells used by the sequences in memory
+  for (int i = 0; i < sequences.size(); i++) {
+    const std::vector<gpt_vocab::id> &tokens = sequences[i];
+
+    // start over at the first free cell when the memory is full
+    if (n_used + tokens.size() > n_free) {
+      if (!flush()) {
+        return false;
+      }
+      n_used = 0;
+    }
+
+    const int cell = first_cell + n_used;
+    for (int t = 0; t < tokens.size(); t++) {
+      if (batch.tokens.size() == n_batch && !flush()) {
+        return false;
+      }
+      if (infos.empty() || infos.back().seq != i) {
+        batch.segments.push_back({0, n_shared + t, cell + t});
+      }
+      batch.segments.back().n_tokens++;
+      batch.tokens.push_back(tokens[t]);
+      batch.n_kv = std::max(batch.n_kv, cell + t + 1);
+      infos.push_back({i, t, cell});
+    }
+    n_used += tokens.size();
+  }
+
+  return flush();
+}
+
+// discard tokens from the key + value memory
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - n_past:    the number of tokens in memory
+//   - n_keep:    the number of tokens to keep at the start of the memory
+//   - n_discard: the number of tokens to discard after them
+//
+// The remaining tokens are moved back by n_discard positions and their keys are
+// rotated to the new positions, so they don't have to be evaluated again.
+//
+void gptj_shift_memory(const gptj_model &model, const int n_threads,
+                       const int n_past, const int n_keep,
+                       const int n_discard) {
+  const auto &hparams = model.hparams;
+
+  const int n_embd = hparams.n_embd;
+  const int n_layer = hparams.n_layer;
+  const int n_ctx = hparams.n_ctx;
+  const int n_head = hparams.n_head;
+  const int n_rot = hparams.n_rot;
+
+  const int d_key = n_embd / n_head;
+  const int n_move = n_past - n_keep - n_discard;
+  if (n_discard <= 0 || n_move < 0) {
+    return;
+  }
+
+  // rotating by -n_discard is the inverse of the rope applied in gptj_eval()
+  std::vector<float> cos_theta(n_rot / 2);
+  std::vector<float> sin_theta(n_rot / 2);
+  for (int i = 0; i < n_rot / 2; i++) {
+    const float theta = -n_discard * powf(10000.0f, -2.0f * i / n_rot);
+    cos_theta[i] = cosf(theta);
+    sin_theta[i] = sinf(theta);
+  }
+
+  ggml_fp16_t *memory_k = (ggml_fp16_t *)model.memory_k->data;
+  ggml_fp16_t *memory_v = (ggml_fp16_t *)model.memory_v->data;
+
+  auto shift_layer = [&](const int il) {
+    // keys are stored as [n_embd, n_ctx] per layer
+    ggml_fp16_t *k = memory_k + (size_t)il * n_ctx * n_embd;
+    memmove(k + (size_t)n_keep * n_embd,
+            k + (size_t)(n_keep + n_discard) * n_embd,
+            (size_t)n_move * n_embd * sizeof(ggml_fp16_t));
+    for (int t = n_keep; t < n_keep + n_move; t++) {
+      for (int h = 0; h < n_head; h++) {
+        ggml_fp16_t *x = k + (size_t)t * n_embd + h * d_key;
+        for (int i = 0; i < n_rot / 2; i++) {
+          const float x0 = ggml_fp16_to_fp32(x[2 * i + 0]);
+          const float x1 = ggml_fp16_to_fp32(x[2 * i + 1]);
+          x[2 * i + 0] = ggml_fp32_to_fp16(x0 * cos_theta[i] - x1 * sin_theta[i]);
+          x[2 * i + 1] = ggml_fp32_to_fp16(x0 * sin_theta[i] + x1 * cos_theta[i]);
+        }
+      }
+    }
+
+    // values are stored transposed as [n_ctx, n_embd] per layer
+    ggml_fp16_t *v = memory_v + (size_t)il * n_ctx * n_embd;
+    for (int e = 0; e < n_embd; e++) {
+      memmove(v + (size_t)e * n_ctx + n_keep,
+              v + (size_t)e * n_ctx + n_keep + n_discard,
+              (size_t)n_move * sizeof(ggml_fp16_t));
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < std::min(n_threads, n_layer); t++) {
+    workers.emplace_back([&, t] {
+      for (int il = t; il < n_layer; il += n_threads) {
+        shift_layer(il);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// copy memory cells to consecutive cells starting at dst
+void gptj_copy_memory(const gptj_model &model, const std::vector<int> &cells,
+                      const int dst) {
+  const auto &hparams = model.hparams;
+
+  const int n_embd = hparams.n_embd;
+  const int n_layer = hparams.n_layer;
+  const int n_ctx = hparams.n_ctx;
+
+  const int n = cells.size();
+  std::vector<ggml_fp16_t> tmp((size_t)n * n_embd);
+
+  for (int il = 0; il < n_layer; il++) {
+    // keys are stored as [n_embd, n_ctx] per layer
+    ggml_fp16_t *k =
+        (ggml_fp16_t *)model.memory_k->data + (size_t)il * n_ctx * n_embd;
+    for (int j = 0; j < n; j++) {
+      memcpy(tmp.data() + (size_t)j * n_embd, k + (size_t)cells[j] * n_embd,
+             n_embd * sizeof(ggml_fp16_t));
+    }
+    memcpy(k + (size_t)dst * n_embd, tmp.data(),
+           (size_t)n * n_embd * sizeof(ggml_fp16_t));
+
+    // values are stored transposed as [n_ctx, n_embd] per layer
+    ggml_fp16_t *v =
+        (ggml_fp16_t *)model.memory_v->data + (size_t)il * n_ctx * n_embd;
+    for (int e = 0; e < n_embd; e++) {
+      ggml_fp16_t *row = v + (size_t)e * n_ctx;
+      for (int j = 0; j < n; j++) {
+        tmp[j] = row[cells[j]];
+      }
+      memcpy(row + dst, tmp.data(), n * sizeof(ggml_fp16_t));
+    }
+  }
+}
+
+// Proposes draft tokens by looking up the latest n-gram in the previous tokens
+// and copying the tokens that followed its most recent occurrence.
+class GptjPromptLookup {
  public:
-  void Init(const int capacity) {
-    capacity_ = capacity;
-    Clear();
+  void Init(const int ngram) {
+    ngram_ = ngram;
+    tokens_.clear();
+    index_.clear();
   }
 
   void Add(const gpt_vocab::id token) {
-    if (tokens_.size() < capacity_) {
-      tokens_.push_back(token);
-    } else {
-      tokens_[pos_] = token;
+    tokens_.push_back(token);
+    // The n-gram before the new token now has a continuation. The latest
+    // n-gram is never indexed so that it can't match itself.
+    const int end = tokens_.size() - 1;
+    if (end >= ngram_) {
+      index_[Hash(end - ngram_)] = end;
     }
-    pos_ = (pos_ + 1) % capacity_;
   }
 
-  // Returns last n tokens.
-  std::unordered_set<gpt_vocab::id> GetRecent(int n) const {
-    const int size = Size();
-    n = std::min(size, n);
-    std::unordered_set<gpt_vocab::id> result;
-    if (n == 0) {
+  // Returns up to n tokens that followed the latest n-gram.
+  std::vector<gpt_vocab::id> Draft(const int n) const {
+    std::vector<gpt_vocab::id> result;
+    const int size = tokens_.size();
+    if (n <= 0 || size < ngram_) {
       return result;
     }
-    const int start = (pos_ - n + size) % size;
-    if (start < pos_) {
-      result.insert(tokens_.begin() + start, tokens_.begin() + pos_);
-    } else {
-      result.insert(tokens_.begin() + start, tokens_.end());
-      result.insert(tokens_.begin(), tokens_.begin() + pos_);
+    const auto it = index_.find(Hash(size - ngram_));
+    if (it == index_.end()) {
+      return result;
+    }
+    const int start = it->second;
+    if (!std::equal(tokens_.begin() + start - ngram_, tokens_.begin() + start,
+                    tokens_.end() - ngram_)) {
+      return result;  // hash collision
+    }
+    for (int i = start; i < size && result.size() < n; i++) {
+      result.push_back(tokens_[i]);
     }
     return result;
   }
 
+ private:
+  // FNV-1a hash of the n-gram starting at pos.
+  uint64_t Hash(const int pos) const {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = pos; i < pos + ngram_; i++) {
+      hash = (hash ^ (uint32_t)tokens_[i]) * 0x100000001b3;
+    }
+    return hash;
+  }
+
+  int ngram_ = 0;
+  std::vector<gpt_vocab::id> tokens_;
+  // n-gram hash -> position of the token that followed it
+  std::unordered_map<uint64_t, int> index_;
+};
+
+// Memory cells shared by sequences with a common prefix. A cell is freed when
+// no sequence refers to it anymore.
+class GptjMemoryCells {
+ public:
+  void Init(const int begin, const int end) {
+    begin_ = begin;
+    refs_.assign(std::max(0, end - begin), 0);
+  }
+
+  // Returns a free cell or -1 if all cells are in use.
+  int Allocate() {
+    for (int i = 0; i < refs_.size(); i++) {
+      if (refs_[i] == 0) {
+        refs_[i] = 1;
+        return begin_ + i;
+      }
+    }
+    return -1;
+  }
+
+  void Retain(const std::vector<int> &cells) {
+    for (const int cell : cells) {
+      refs_[cell - begin_]++;
+    }
+  }
+
+  void Release(const std::vector<int> &cells) {
+    for (const int cell : cells) {
+      refs_[cell - begin_]--;
+    }
+  }
+
+ private:
+  int begin_ = 0;
+  std::vector<int> refs_;
+};
+
+// Histogram of latencies in ms with buckets that grow by 2^(1/8) from 1 us.
+class GptjLatencyHistogram {
+ public:
+  void Add(const double ms) {
+    int bucket = 0;
+    if (ms > kMinMs) {
+      bucket = std::min(kNumBuckets - 1,
+                        (int)std::ceil(std::log2(ms / kMinMs) * kPerOctave));
+    }
+    counts_[bucket]++;
+    n_++;
+    max_ms_ = std::max(max_ms_, ms);
+  }
+
+  // Returns the upper bound of the bucket of the q-quantile, or 0 if there
+  // are no latencies.
+  double Percentile(const double q) const {
+    if (n_ == 0) {
+      return 0.0;
+    }
+    const uint64_t rank = std::max<uint64_t>(1, std::ceil(q * n_));
+    uint64_t count = 0;
+    for (int i = 0; i < kNumBuckets; i++) {
+      count += counts_[i];
+      if (count >= rank) {
+        return std::min(max_ms_, kMinMs * std::exp2((double)i / kPerOctave));
+      }
+    }
+    return max_ms_;
+  }
+
   void Clear() {
-    tokens_.clear();
-    pos_ = 0;
+    counts_.fill(0);
+    n_ = 0;
+    max_ms_ = 0.0;
+  }
+
+ private:
+  static constexpr double kMinMs = 0.001;
+  static constexpr int kPerOctave = 8;
+  static constexpr int kNumBuckets = 27 * kPerOctave;
+
+  std::array<uint64_t, kNumBuckets> counts_ = {};
+  uint64_t n_ = 0;
+  double max_ms_ = 0.0;
+};
+
+// Collects the statistics of the last call to gptj_generate() and of the
+// session. Durations are passed in microseconds.
+class GptjStats {
+ public:
+  void Begin() {
+    last_ = {};
+    last_.n_calls = 1;
+    session_.n_calls++;
+    last_latencies_.Clear();
+  }
+
+  void AddTokenize(const int64_t us) {
+    last_.tokenize_ms += us / 1000.0;
+    session_.tokenize_ms += us / 1000.0;
+  }
+
+  void AddPromptEval(const int n_tokens, const int64_t us) {
+    for (gptj_stats *stats : {&last_, &session_}) {
+      stats->n_prompt_tokens += n_tokens;
+      stats->prompt_eval_ms += us / 1000.0;
+    }
+  }
+
+  // Adds a decode step that produced n_tokens tokens.
+  void AddDecode(const int n_tokens, const int64_t us) {
+    for (gptj_stats *stats : {&last_, &session_}) {
+      stats->n_decode_tokens += n_tokens;
+      stats->decode_ms += us / 1000.0;
+    }
+    for (int i = 0; i < n_tokens; i++) {
+      last_latencies_.Add(us / 1000.0 / n_tokens);
+      session_latencies_.Add(us / 1000.0 / n_tokens);
+    }
+  }
+
+  void AddSample(const int64_t us) {
+    last_.sample_ms += us / 1000.0;
+    session_.sample_ms += us / 1000.0;
+  }
+
+  void AddCallback(const int64_t us) {
+    last_.callback_ms += us / 1000.0;
+    session_.callback_ms += us / 1000.0;
+  }
+
+  void SetMemory(const uint64_t scratch_bytes, const int n_kv_used,
+                 const int n_kv_size) {
+    for (gptj_stats *stats : {&last_, &session_}) {
+      stats->peak_scratch_bytes =
+          std::max(stats->peak_scratch_bytes, scratch_bytes);
+      stats->n_kv_used = n_kv_used;
+      stats->n_kv_size = n_kv_size;
+    }
   }
 
-  int Size() const { return tokens_.size(); }
+  gptj_stats Get(const bool session) const {
+    gptj_stats stats = session ? session_ : last_;
+    const GptjLatencyHistogram &latencies =
+        session ? session_latencies_ : last_latencies_;
+    stats.decode_p50_ms = latencies.Percentile(0.5);
+    stats.decode_p99_ms = latencies.Percentile(0.99);
+    return stats;
+  }
+
+  void Clear() {
+    last_ = {};
+    session_ = {};
+    last_latencies_.Clear();
+    session_latencies_.Clear();
+  }
 
  private:
-  int capacity_;
-  std::vector<gpt_vocab::id> tokens_;
-  int pos_ = 0;
+  gptj_stats last_ = {};
+  gptj_stats session_ = {};
+  GptjLatencyHistogram last_latencies_;
+  GptjLatencyHistogram session_latencies_;
 };
 
 /**
@@ -852,13 +2658,226 @@ struct gptj_model_context {
   size_t mem_per_token = 0;
   std::vector<float> logits;
   GptjRingBuffer previous_tokens;
+  // Number of tokens stored in the key + value memory.
+  int n_past = 0;
+  // Number of previous tokens that are not yet in memory. The last sampled
+  // token is not evaluated until the next call to gptj_generate().
+  int n_pending = 0;
+  // grammar of the last call to gptj_generate() with its token masks
+  std::string grammar_text;
+  GptjGrammar grammar;
+  GptjTokenTrie token_trie;
+  GptjStats stats;
+  GptjProfile profile;
+  // warmup started by gptj_warmup() in the background and the result of the
+  // last warmup, which is set by the warmup thread before it ends
+  std::thread warmup;
+  bool warmup_ok = true;
+
+  // Waits for a warmup in the background to finish and returns whether the
+  // last warmup succeeded. Called by the functions that use the model so that
+  // they don't evaluate at the same time.
+  bool JoinWarmup() {
+    if (warmup.joinable()) {
+      warmup.join();
+    }
+    return warmup_ok;
+  }
+
+  void Reset() {
+    previous_tokens.Clear();
+    n_past = 0;
+    n_pending = 0;
+  }
+
+  // Number of tokens in the session. Tokens discarded by a context shift are
+  // not counted.
+  int Size() const { return n_past + n_pending; }
+
+  // Keeps the first n tokens of the session and discards the rest.
+  bool Truncate(const int n) {
+    const int size = Size();
+    if (n < 0 || n > size) {
+      return false;
+    }
+    if (n < size) {
+      previous_tokens.RemoveLast(size - n);
+      // The logits of the new last token are no longer available, so it is
+      // evaluated again in the next call to gptj_generate().
+      n_past = std::max(0, std::min(n_past, n - 1));
+      n_pending = n - n_past;
+    }
+    return true;
+  }
+};
+
+// Makes room in memory for n more tokens. The context is shifted if enabled,
+// otherwise the last tokens in memory are overwritten.
+void gptj_make_room(gptj_model_context *model_ctx, const gptj_params &params,
+                    const int n) {
+  const int n_ctx = model_ctx->model.hparams.n_ctx;
+  int &n_past = model_ctx->n_past;
+  if (n_past + n <= n_ctx) {
+    return;
+  }
+  if (!params.context_shift) {
+    n_past = std::max(0, n_ctx - n);
+    return;
+  }
+  // keep the first n_keep tokens and discard half of the rest
+  const int n_keep = std::max(0, std::min({params.n_keep, n_past, n_ctx - n}));
+  const int n_discard = std::max((n_past - n_keep) / 2, n_past + n - n_ctx);
+  gptj_shift_memory(model_ctx->model, params.n_threads, n_past, n_keep,
+                    n_discard);
+  n_past -= n_discard;
+}
+
+// Evaluates the pending previous tokens followed by the given tokens in
+// batches. The logits of the last token are kept in the model context. If
+// logits is not null, the logits of each of the given tokens are written to it.
+bool gptj_eval_tokens(gptj_model_context *model_ctx, const gptj_params &params,
+                      const std::vector<gpt_vocab::id> &tokens,
+                      float *logits = nullptr) {
+  GptjRingBuffer &previous_tokens = model_ctx->previous_tokens;
+  int &n_past = model_ctx->n_past;
+  int &n_pending = model_ctx->n_pending;
+  const int n_vocab = model_ctx->model.hparams.n_vocab;
+
+  std::vector<gpt_vocab::id> embd_inp = previous_tokens.GetLast(n_pending);
+  previous_tokens.RemoveLast(n_pending);
+  // index of the first given token in embd_inp
+  const int n_skip = n_pending;
+  n_pending = 0;
+  embd_inp.insert(embd_inp.end(), tokens.begin(), tokens.end());
+
+  const int n_batch = std::max(1, params.n_batch);
+  for (int i = 0; i < embd_inp.size(); i += n_batch) {
+    const std::vector<gpt_vocab::id> embd(
+        embd_inp.begin() + i,
+        embd_inp.begin() + std::min(i + n_batch, (int)embd_inp.size()));
+    for (const gpt_vocab::id id : embd) {
+      previous_tokens.Add(id);
+      n_pending++;
+    }
+
+    gptj_make_room(model_ctx, params, embd.size());
+    if (!gptj_eval(model_ctx->model, params.n_threads, n_past, embd,
+                   model_ctx->logits, model_ctx->mem_per_token,
+                   logits != nullptr)) {
+      fprintf(stderr, "%s: failed to predict\n", __func__);
+      return false;
+    }
+    n_past += embd.size();
+    n_pending = 0;
+
+    if (logits != nullptr) {
+      for (int j = std::max(i, n_skip); j < i + embd.size(); j++) {
+        memcpy(logits + (size_t)(j - n_skip) * n_vocab,
+               model_ctx->logits.data() + (size_t)(j - i) * n_vocab,
+               sizeof(float) * n_vocab);
+      }
+      model_ctx->logits.erase(model_ctx->logits.begin(),
+                              model_ctx->logits.end() - n_vocab);
+    }
+  }
+  return true;
+}
+
+// Reads a byte of each page of the weights so that pages that were swapped
+// out or not yet faulted in are resident. The layers of a lazily loaded model
+// are paged in while evaluating and are skipped.
+void gptj_touch_weights(const gptj_model &model) {
+  const size_t page_size = 4096;
+  unsigned char sum = 0;
+  for (const auto &[name, tensor] : model.tensors) {
+    if (model.pager != nullptr && name.rfind("transformer.h.", 0) == 0) {
+      continue;
+    }
+    const volatile unsigned char *data =
+        (const volatile unsigned char *)tensor->data;
+    const size_t size = ggml_nbytes(tensor);
+    for (size_t i = 0; i < size; i += page_size) {
+      sum += data[i];
+    }
+  }
+  (void)sum;
+}
+
+// Evaluates a prompt batch and a decoded token after the session so that the
+// memory per token is estimated, the eval buffer has its final size and the
+// weights are paged in before the first request. The tokens are not added to
+// the session, so the memory they use stays free.
+bool gptj_warmup_model(gptj_model_context *model_ctx,
+                       const gptj_params &params) {
+  gptj_model &model = model_ctx->model;
+  gptj_touch_weights(model);
+
+  const int n_ctx = model.hparams.n_ctx;
+  const int n_past = model_ctx->n_past;
+  // a batch and the decoded token after it
+  const int n_batch =
+      std::min(std::max(1, params.n_batch), n_ctx - n_past - 1);
+  if (n_batch <= 0) {
+    return true;
+  }
+
+  // the evals are not profiled
+  GptjProfile *profile = model.profile;
+  model.profile = nullptr;
+  std::vector<float> logits;
+  bool ok = true;
+  if (model_ctx->mem_per_token == 0) {
+    ok = gptj_eval(model, params.n_threads, n_past, {0}, logits,
+                   model_ctx->mem_per_token);
+  }
+  ok = ok && gptj_eval(model, params.n_threads, n_past,
+                       std::vector<gpt_vocab::id>(n_batch, 0), logits,
+                       model_ctx->mem_per_token);
+  ok = ok && gptj_eval(model, params.n_threads, n_past + n_batch, {0}, logits,
+                       model_ctx->mem_per_token);
+  model.profile = profile;
+  if (!ok) {
+    fprintf(stderr, "%s: failed to predict\n", __func__);
+  }
+  return ok;
+}
+
+// Returns the fastest instructions that ggml can be built for that the CPU
+// supports, so that the matching library can be loaded. Returns "" on CPUs
+// other than x86.
+const char *gptj_cpu_instructions() {
+  const int index = gptj_cpu_instructions_index();
+  return index < 0 ? "" : gptj_instructions[index];
+}
 
-  void Reset() { previous_tokens.Clear(); }
-};
+// Returns the instructions that this build of the library and ggml are for.
+const char *gptj_build_instructions() { return GPTJ_INSTRUCTIONS; }
 
 gptj_model_context *gptj_load_model(const char *filename) {
+  return gptj_load_model_with_params(filename, gptj_load_params());
+}
+
+gptj_model_context *gptj_load_model_with_params(const char *filename,
+                                                gptj_load_params params) {
+  // check the instructions before any ggml code runs
+  const int cpu_index = gptj_cpu_instructions_index();
+  const int build_index = gptj_instructions_index(GPTJ_INSTRUCTIONS);
+  if (cpu_index >= 0 && build_index > cpu_index) {
+    fprintf(stderr,
+            "%s: this build of the library is for %s but the CPU only "
+            "supports %s\n",
+            __func__, GPTJ_INSTRUCTIONS, gptj_instructions[cpu_index]);
+    return nullptr;
+  }
+  if (cpu_index >= 0 && build_index >= 0 && build_index < cpu_index) {
+    fprintf(stderr,
+            "%s: warning: this build of the library is for %s but the CPU "
+            "supports %s, which is faster\n",
+            __func__, GPTJ_INSTRUCTIONS, gptj_instructions[cpu_index]);
+  }
+
   gptj_model_context *ctx = new gptj_model_context;
-  if (!gptj_model_load(filename, ctx->model, ctx->vocab)) {
+  if (!gptj_model_load(filename, ctx->model, ctx->vocab, params)) {
     delete ctx;
     return nullptr;
   }
@@ -867,13 +2886,15 @@ gptj_model_context *gptj_load_model(const char *filename) {
 }
 
 void gptj_free_model(gptj_model_context *ctx) {
-  ggml_free(ctx->model.ctx);
+  ctx->JoinWarmup();
+  gptj_model_free(ctx->model);
   delete ctx;
 }
 
 bool gptj_generate(gptj_model_context *model_ctx, const char *prompt,
                    gptj_params params, const bool reset,
                    bool (*callback)(const char *token)) {
+  model_ctx->JoinWarmup();
   if (reset) {
     model_ctx->Reset();
   }
@@ -892,8 +2913,11 @@ bool gptj_generate(gptj_model_context *model_ctx, const char *prompt,
   size_t &mem_per_token = model_ctx->mem_per_token;
   std::vector<float> &logits = model_ctx->logits;
   GptjRingBuffer &previous_tokens = model_ctx->previous_tokens;
+  GptjStats &stats = model_ctx->stats;
   const int32_t n_ctx = model.hparams.n_ctx;
 
+  stats.Begin();
+
   if (params.repeat_last_n < 0) {
     params.repeat_last_n = n_ctx;
   }
@@ -901,93 +2925,775 @@ bool gptj_generate(gptj_model_context *model_ctx, const char *prompt,
   const bool repeat_penalty_enabled =
       !(params.repeat_penalty == 1.0f || params.repeat_last_n == 0);
 
-  int n_past = previous_tokens.Size();
+  int &n_past = model_ctx->n_past;
+  int &n_pending = model_ctx->n_pending;
 
   // Handle empty prompt.
-  if (n_past == 0 && std::strlen(prompt) == 0) {
+  if (model_ctx->Size() == 0 && std::strlen(prompt) == 0) {
     return true;
   }
 
   // tokenize the prompt
-  std::vector<gpt_vocab::id> embd_inp = ::gpt_tokenize(vocab, prompt);
+  const int64_t t_tokenize_us = ggml_time_us();
+  const std::vector<gpt_vocab::id> prompt_tokens = ::gpt_tokenize(vocab, prompt);
+  stats.AddTokenize(ggml_time_us() - t_tokenize_us);
+
+  // The grammar masks the logits of tokens that can't come next. It applies to
+  // the generated text only.
+  const bool grammar_enabled = params.grammar != nullptr && *params.grammar;
+  GptjGrammar &grammar = model_ctx->grammar;
+  GptjGrammar::Stacks grammar_stacks;
+  if (grammar_enabled) {
+    if (model_ctx->grammar_text != params.grammar) {
+      model_ctx->grammar_text.clear();
+      if (!grammar.Parse(params.grammar)) {
+        return false;
+      }
+      model_ctx->grammar_text = params.grammar;
+    }
+    if (model_ctx->token_trie.Empty()) {
+      model_ctx->token_trie.Build(vocab);
+    }
+    grammar_stacks = grammar.Start();
+  }
+
+  // evaluate the previous tokens that are not yet in memory and the prompt
+  const int n_prompt = n_pending + prompt_tokens.size();
+  const int64_t t_prompt_us = ggml_time_us();
+  if (!gptj_eval_tokens(model_ctx, params, prompt_tokens)) {
+    return false;
+  }
+  if (n_prompt > 0) {
+    const int n_batch = std::min(n_prompt, std::max(1, params.n_batch));
+    stats.AddPromptEval(n_prompt, ggml_time_us() - t_prompt_us);
+    stats.SetMemory((uint64_t)mem_per_token * n_batch, n_past, n_ctx);
+  }
 
-  params.n_predict = std::min(n_ctx - (int)embd_inp.size(), params.n_predict);
+  if (!params.context_shift) {
+    params.n_predict = std::min(n_ctx - n_past, params.n_predict);
+  }
 
   std::vector<gpt_vocab::id> embd;
 
-  bool processing_input = true;
-  for (int i = embd.size(); i < embd_inp.size() + params.n_predict; i++) {
+  // Tokens are drafted from the prompt and previous tokens, evaluated together
+  // with the sampled token, and kept only if the model agrees with them.
+  const bool draft_enabled = params.n_draft > 0 && params.draft_ngram > 0;
+  GptjPromptLookup lookup;
+  std::vector<gpt_vocab::id> draft;
+  if (draft_enabled) {
+    lookup.Init(params.draft_ngram);
+    for (const gpt_vocab::id id :
+         previous_tokens.GetLast(previous_tokens.Size())) {
+      lookup.Add(id);
+    }
+  }
+
+  // passes a token to the callback and records the time spent in it
+  int64_t t_callback_us = 0;
+  auto emit = [&](const gpt_vocab::id id) {
+    const int64_t t_start_us = ggml_time_us();
+    const bool result = (*callback)(vocab.c_token(id));
+    const int64_t t_us = ggml_time_us() - t_start_us;
+    t_callback_us += t_us;
+    stats.AddCallback(t_us);
+    return result;
+  };
+
+  for (int i = 0; i < params.n_predict; i++) {
+    // a decode step lasts from evaluating the last sampled token to sampling
+    // the next one, without the time spent in the callback
+    const int64_t t_step_us = ggml_time_us();
+    const int64_t t_step_callback_us = t_callback_us;
+
     // predict
     if (embd.size() > 0) {
-      n_past = std::min(n_ctx - (int)embd.size(), n_past);
+      if (draft_enabled) {
+        // leave room for the token sampled after the last drafted token
+        const int n_draft = std::min({params.n_draft, params.n_predict - i - 1,
+                                      n_ctx - n_past - (int)embd.size()});
+        draft = lookup.Draft(n_draft);
+        embd.insert(embd.end(), draft.begin(), draft.end());
+      }
+
+      gptj_make_room(model_ctx, params, embd.size());
       if (!gptj_eval(model, params.n_threads, n_past, embd, logits,
-                     mem_per_token)) {
+                     mem_per_token, !draft.empty())) {
         fprintf(stderr, "%s: failed to predict\n", __func__);
         return false;
       }
+      stats.SetMemory((uint64_t)mem_per_token * embd.size(),
+                      n_past + embd.size(), n_ctx);
     }
 
     n_past += embd.size();
+    n_pending = 0;
     embd.clear();
 
-    if (i >= embd_inp.size()) {
-      processing_input = false;
-      // sample next token
-      const int top_k = params.top_k;
-      const float top_p = params.top_p;
-      const float temp = params.temp;
-      const float repeat_penalty = params.repeat_penalty;
-      std::unordered_set<gpt_vocab::id> recent_tokens;
+    // sample next token
+    const int top_k = params.top_k;
+    const float top_p = params.top_p;
+    const float temp = params.temp;
+    const float repeat_penalty = params.repeat_penalty;
+    std::unordered_set<gpt_vocab::id> recent_tokens;
+    if (repeat_penalty_enabled) {
+      recent_tokens = previous_tokens.GetRecent(params.repeat_last_n);
+    }
+
+    const int n_vocab = model.hparams.n_vocab;
+
+    gpt_vocab::id id = 0;
+
+    // logits of the sampled token followed by logits of each drafted token
+    float *logits_rows =
+        logits.data() + (logits.size() - (draft.size() + 1) * n_vocab);
+    int n_accepted = 0;
+    while (true) {
+      float *logits_row = logits_rows + n_accepted * n_vocab;
+      const int64_t t_sample_us = ggml_time_us();
+      if (grammar_enabled) {
+        grammar.Apply(grammar_stacks, model_ctx->token_trie,
+                      /* end of text token */ 50256, logits_row, n_vocab);
+      }
+      id = gpt_sample_top_k_top_p(vocab, logits_row, top_k, top_p, temp,
+                                  repeat_penalty, recent_tokens, rng);
+      if (grammar_enabled) {
+        grammar_stacks = grammar.AcceptToken(grammar_stacks, vocab.token(id));
+      }
+      stats.AddSample(ggml_time_us() - t_sample_us);
+      if (n_accepted == draft.size() || id != draft[n_accepted]) {
+        break;
+      }
+
+      // the drafted token is the one the model generated
+      n_accepted++;
+      previous_tokens.Add(id);
+      lookup.Add(id);
+      if (id == /* end of text token */ 50256 || !emit(id)) {
+        stats.AddDecode(n_accepted, ggml_time_us() - t_step_us -
+                                        (t_callback_us - t_step_callback_us));
+        return true;
+      }
       if (repeat_penalty_enabled) {
         recent_tokens = previous_tokens.GetRecent(params.repeat_last_n);
       }
+    }
+
+    stats.AddDecode(n_accepted + 1, ggml_time_us() - t_step_us -
+                                        (t_callback_us - t_step_callback_us));
+
+    // rejected tokens stay in the memory beyond n_past and get overwritten
+    n_past -= (int)draft.size() - n_accepted;
+    i += n_accepted;
+    draft.clear();
+
+    // add it to the context
+    embd.push_back(id);
+    previous_tokens.Add(id);
+    n_pending++;
+    if (draft_enabled) {
+      lookup.Add(id);
+    }
+    if (id == /* end of text token */ 50256 || !emit(id)) {
+      return true;
+    }
+  }
+
+  return true;
+}
+
+// Generates the n_best most likely continuations of the prompt using beam
+// search with n_beams beams. The beams share the memory cells of their common
+// prefix and are evaluated together in one batch per step. Sequences are
+// ranked by their log-probability divided by their length and passed to the
+// callback token by token along with their rank. The best sequence is kept in
+// the session. Sampling parameters are not used.
+bool gptj_beam_search(gptj_model_context *model_ctx, const char *prompt,
+                      gptj_params params, const int n_beams, const int n_best,
+                      const bool reset,
+                      bool (*callback)(const int index, const char *token)) {
+  model_ctx->JoinWarmup();
+  if (reset) {
+    model_ctx->Reset();
+  }
+  if (params.n_threads <= 0) {
+    params.n_threads =
+        std::min(4, (int32_t)std::thread::hardware_concurrency());
+  }
+  if (n_beams <= 0 || n_best <= 0) {
+    return false;
+  }
+
+  gpt_vocab &vocab = model_ctx->vocab;
+  gptj_model &model = model_ctx->model;
+  const int n_ctx = model.hparams.n_ctx;
+  const int n_vocab = model.hparams.n_vocab;
+
+  if (!gptj_eval_tokens(model_ctx, params, gpt_tokenize(vocab, prompt))) {
+    return false;
+  }
+  // Handle empty prompt.
+  if (model_ctx->n_past == 0) {
+    return true;
+  }
+
+  // cells before n_prefix hold the session and are visible to every beam
+  const int n_prefix = model_ctx->n_past;
+  GptjMemoryCells cells;
+  cells.Init(n_prefix, n_ctx);
 
-      const int n_vocab = model.hparams.n_vocab;
+  struct beam {
+    std::vector<gpt_vocab::id> tokens;
+    std::vector<int> cells;  // cells of the evaluated tokens
+    double logprob = 0.0;
 
-      gpt_vocab::id id = 0;
+    double Score() const { return logprob / std::max<int>(1, tokens.size()); }
+  };
+  auto by_score = [](const beam &a, const beam &b) {
+    return a.Score() > b.Score();
+  };
 
-      {
-        id = gpt_sample_top_k_top_p(
-            vocab, logits.data() + (logits.size() - n_vocab), top_k, top_p,
-            temp, repeat_penalty, recent_tokens, rng);
+  std::vector<beam> beams(1);
+  std::vector<beam> finished;
+  // logits of the last evaluated token of each beam
+  std::vector<float> logits = model_ctx->logits;
+
+  for (int step = 0; step < params.n_predict && !beams.empty(); step++) {
+    // extend every beam with its most likely tokens
+    struct candidate {
+      double logprob;
+      int beam;
+      gpt_vocab::id token;
+    };
+    std::vector<candidate> candidates;
+    std::vector<std::pair<float, gpt_vocab::id>> logits_id(n_vocab);
+    for (int b = 0; b < beams.size(); b++) {
+      const float *row = logits.data() + (size_t)b * n_vocab;
+
+      float maxl = -INFINITY;
+      for (int i = 0; i < n_vocab; i++) {
+        maxl = std::max(maxl, row[i]);
+      }
+      double sum = 0.0;
+      for (int i = 0; i < n_vocab; i++) {
+        sum += exp(row[i] - maxl);
+        logits_id[i] = std::make_pair(row[i], i);
+      }
+      const double log_sum = maxl + log(sum);
+
+      // one more than the number of beams in case one of them ends the text
+      const int top_k = std::min(n_beams + 1, n_vocab);
+      std::partial_sort(logits_id.begin(), logits_id.begin() + top_k,
+                        logits_id.end(),
+                        [](const std::pair<float, gpt_vocab::id> &a,
+                           const std::pair<float, gpt_vocab::id> &b) {
+                          return a.first > b.first;
+                        });
+      for (int i = 0; i < top_k; i++) {
+        candidates.push_back({beams[b].logprob + logits_id[i].first - log_sum,
+                              b, logits_id[i].second});
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const candidate &a, const candidate &b) {
+                return a.logprob > b.logprob;
+              });
+
+    std::vector<beam> next;
+    for (const candidate &c : candidates) {
+      if (next.size() == n_beams) {
+        break;
       }
+      beam child = beams[c.beam];
+      child.tokens.push_back(c.token);
+      child.logprob = c.logprob;
+      cells.Retain(child.cells);
+      if (c.token == /* end of text token */ 50256) {
+        finished.push_back(std::move(child));
+      } else {
+        next.push_back(std::move(child));
+      }
+    }
+    for (const beam &b : beams) {
+      cells.Release(b.cells);
+    }
+    beams = std::move(next);
 
-      // add it to the context
-      embd.push_back(id);
-    } else {
-      // if here, it means we are still processing the input prompt
-      for (int k = i; k < embd_inp.size(); k++) {
-        embd.push_back(embd_inp[k]);
-        if (embd.size() > params.n_batch) {
-          break;
-        }
+    // keep only the best finished sequences
+    std::sort(finished.begin(), finished.end(), by_score);
+    while (finished.size() > n_best) {
+      cells.Release(finished.back().cells);
+      finished.pop_back();
+    }
+    // Stop when no beam can beat the finished sequences. Extending a beam can
+    // only lower its log-probability, which is negative, so the best score it
+    // can reach is its log-probability divided by the longest length.
+    if (finished.size() >= n_best && !beams.empty()) {
+      double max_logprob = -INFINITY;
+      for (const beam &b : beams) {
+        max_logprob = std::max(max_logprob, b.logprob);
+      }
+      if (max_logprob < finished.back().Score() * params.n_predict) {
+        break;
       }
-      i += embd.size() - 1;
+    }
+    if (step + 1 == params.n_predict || beams.empty()) {
+      break;
     }
 
-    for (auto id : embd) {
-      previous_tokens.Add(id);
-      if (!processing_input) {
-        if (id == /* end of text token */ 50256 ||
-            !(*callback)(vocab.id_to_token[id].c_str())) {
-          return true;
-        }
+    // evaluate the new token of every beam in one batch
+    std::vector<int> new_cells;
+    for (int b = 0; b < beams.size(); b++) {
+      const int cell = cells.Allocate();
+      if (cell < 0) {
+        break;
+      }
+      new_cells.push_back(cell);
+    }
+    if (new_cells.size() < beams.size()) {
+      // out of memory, the last tokens are left unevaluated
+      cells.Release(new_cells);
+      break;
+    }
+
+    std::vector<gpt_vocab::id> tokens;
+    std::vector<const std::vector<int> *> beam_cells;
+    for (int b = 0; b < beams.size(); b++) {
+      beams[b].cells.push_back(new_cells[b]);
+      tokens.push_back(beams[b].tokens.back());
+      beam_cells.push_back(&beams[b].cells);
+    }
+    const gptj_batch batch =
+        gptj_make_sequences_batch(n_prefix, tokens, beam_cells);
+
+    if (!gptj_eval_batch(model, params.n_threads, batch, logits,
+                         model_ctx->mem_per_token, true)) {
+      fprintf(stderr, "%s: failed to predict\n", __func__);
+      return false;
+    }
+  }
+
+  std::vector<beam> results = std::move(finished);
+  results.insert(results.end(), beams.begin(), beams.end());
+  std::sort(results.begin(), results.end(), by_score);
+
+  // continue the session with the best sequence
+  if (!results.empty()) {
+    const beam &best = results.front();
+    gptj_copy_memory(model, best.cells, n_prefix);
+    for (const gpt_vocab::id id : best.tokens) {
+      model_ctx->previous_tokens.Add(id);
+    }
+    model_ctx->n_past = n_prefix + best.cells.size();
+    model_ctx->n_pending = best.tokens.size() - best.cells.size();
+  }
+
+  for (int i = 0; i < std::min<int>(n_best, results.size()); i++) {
+    for (const gpt_vocab::id id : results[i].tokens) {
+      if (id == /* end of text token */ 50256) {
+        break;
+      }
+      if (!(*callback)(i, vocab.c_token(id))) {
+        return true;
       }
     }
+  }
+
+  return true;
+}
+
+// Generates n completions of the prompt. The prompt is evaluated once and its
+// memory is shared by the completions, whose tokens are evaluated together in
+// one batch per step. Tokens are passed to the callback along with the index
+// of their completion, and returning false stops that completion. Only the
+// prompt is kept in the session.
+bool gptj_generate_n(gptj_model_context *model_ctx, const char *prompt,
+                     gptj_params params, const int n, const bool reset,
+                     bool (*callback)(const int index, const char *token)) {
+  model_ctx->JoinWarmup();
+  if (reset) {
+    model_ctx->Reset();
+  }
+  if (params.seed < 0) {
+    params.seed = time(NULL);
+  }
+  if (params.n_threads <= 0) {
+    params.n_threads =
+        std::min(4, (int32_t)std::thread::hardware_concurrency());
+  }
+  if (n <= 0) {
+    return false;
+  }
+
+  gpt_vocab &vocab = model_ctx->vocab;
+  gptj_model &model = model_ctx->model;
+  const int32_t n_ctx = model.hparams.n_ctx;
+  const int n_vocab = model.hparams.n_vocab;
+
+  if (params.repeat_last_n < 0) {
+    params.repeat_last_n = n_ctx;
+  }
+  params.repeat_last_n = std::min(n_ctx, params.repeat_last_n);
+  const bool repeat_penalty_enabled =
+      !(params.repeat_penalty == 1.0f || params.repeat_last_n == 0);
+
+  if (!gptj_eval_tokens(model_ctx, params, gpt_tokenize(vocab, prompt))) {
+    return false;
+  }
+  // Handle empty prompt.
+  if (model_ctx->n_past == 0) {
+    return true;
+  }
+
+  // cells before n_prefix hold the session and are visible to every sequence
+  const int n_prefix = model_ctx->n_past;
+  GptjMemoryCells cells;
+  cells.Init(n_prefix, n_ctx);
 
-    // end of text token
-    if (embd.back() == 50256) {
+  struct sequence {
+    std::mt19937 rng;
+    GptjRingBuffer previous_tokens;
+    std::vector<int> cells;
+    bool done = false;
+  };
+  std::vector<sequence> seqs(n);
+  for (int i = 0; i < n; i++) {
+    seqs[i].rng.seed(params.seed + i);
+    seqs[i].previous_tokens = model_ctx->previous_tokens;
+  }
+
+  // logits of the last evaluated token of each active sequence
+  std::vector<float> logits = model_ctx->logits;
+  // the first tokens of all sequences are sampled from the prompt logits
+  std::vector<int> rows(n, 0);
+
+  for (int step = 0; step < params.n_predict; step++) {
+    std::vector<gpt_vocab::id> tokens;
+    std::vector<const std::vector<int> *> seq_cells;
+    std::vector<int> active;
+    for (int i = 0; i < n; i++) {
+      sequence &seq = seqs[i];
+      if (seq.done) {
+        continue;
+      }
+
+      std::unordered_set<gpt_vocab::id> recent_tokens;
+      if (repeat_penalty_enabled) {
+        recent_tokens = seq.previous_tokens.GetRecent(params.repeat_last_n);
+      }
+      const gpt_vocab::id id = gpt_sample_top_k_top_p(
+          vocab, logits.data() + (size_t)rows[i] * n_vocab, params.top_k,
+          params.top_p, params.temp, params.repeat_penalty, recent_tokens,
+          seq.rng);
+      seq.previous_tokens.Add(id);
+
+      if (id == /* end of text token */ 50256 ||
+          !(*callback)(i, vocab.c_token(id))) {
+        seq.done = true;
+        continue;
+      }
+      if (step + 1 == params.n_predict) {
+        continue;
+      }
+
+      const int cell = cells.Allocate();
+      if (cell < 0) {
+        // out of memory
+        seq.done = true;
+        continue;
+      }
+      seq.cells.push_back(cell);
+      rows[i] = active.size();
+      active.push_back(i);
+      tokens.push_back(id);
+      seq_cells.push_back(&seq.cells);
+    }
+    if (active.empty()) {
       break;
     }
+
+    // evaluate the new token of every sequence in one batch
+    const gptj_batch batch =
+        gptj_make_sequences_batch(n_prefix, tokens, seq_cells);
+    if (!gptj_eval_batch(model, params.n_threads, batch, logits,
+                         model_ctx->mem_per_token, true)) {
+      fprintf(stderr, "%s: failed to predict\n", __func__);
+      return false;
+    }
   }
 
   return true;
 }
 
+// Computes an embedding of each text by pooling the hidden states of its
+// tokens. The texts are packed into batches of up to n_batch tokens that are
+// evaluated together using the free memory after the session, which is not
+// changed. The language model head is not evaluated, and neither are the
+// layers after the requested one.
+//
+//   - layer:      layer whose outputs are pooled (-1 = final hidden states)
+//   - pooling:    0 = mean of all tokens, 1 = last token
+//   - embeddings: n_texts * n_embd floats
+//
+bool gptj_embeddings(gptj_model_context *model_ctx, const char **texts,
+                     const int n_texts, gptj_params params, int layer,
+                     const int pooling, float *embeddings) {
+  model_ctx->JoinWarmup();
+  if (params.n_threads <= 0) {
+    params.n_threads =
+        std::min(4, (int32_t)std::thread::hardware_concurrency());
+  }
+
+  const gptj_model &model = model_ctx->model;
+  const int n_ctx = model.hparams.n_ctx;
+  const int n_embd = model.hparams.n_embd;
+  const int n_layer = model.hparams.n_layer;
+  const int n_past = model_ctx->n_past;
+  const int n_batch = std::max(1, params.n_batch);
+
+  if (layer < 0) {
+    layer = n_layer;
+  }
+  if (layer > n_layer) {
+    fprintf(stderr, "%s: invalid layer %d\n", __func__, layer);
+    return false;
+  }
+
+  const int n_free = n_ctx - n_past;
+  if (n_free <= 0) {
+    fprintf(stderr, "%s: no free memory after the session\n", __func__);
+    return false;
+  }
+
+  // estimate the memory per token before evaluating large batches
+  if (model_ctx->mem_per_token == 0) {
+    std::vector<float> logits;
+    if (!gptj_eval(model, params.n_threads, n_past, {0}, logits,
+                   model_ctx->mem_per_token)) {
+      fprintf(stderr, "%s: failed to predict\n", __func__);
+      return false;
+    }
+  }
+
+  std::vector<std::vector<gpt_vocab::id>> tokens(n_texts);
+  for (int i = 0; i < n_texts; i++) {
+    tokens[i] = gpt_tokenize(model_ctx->vocab, texts[i]);
+    if (tokens[i].size() > n_free) {
+      fprintf(stderr, "%s: truncating text %d from %zu to %d tokens\n",
+              __func__, i, tokens[i].size(), n_free);
+      tokens[i].resize(n_free);
+    }
+  }
+
+  // each token attends to the tokens before it in its text, after the session
+  std::fill(embeddings, embeddings + (size_t)n_texts * n_embd, 0.0f);
+  return gptj_eval_sequences(
+      model, params.n_threads, n_batch, 0, n_past, layer, tokens,
+      model_ctx->mem_per_token,
+      [&](const float *h, const int text, const int pos) {
+        const int n = tokens[text].size();
+        if (pooling == 1 && pos != n - 1) {
+          return;
+        }
+        const float scale = pooling == 1 ? 1.0f : 1.0f / n;
+        float *out = embeddings + (size_t)text * n_embd;
+        for (int j = 0; j < n_embd; j++) {
+          out[j] += h[j] * scale;
+        }
+      });
+}
+
+// Computes the log-probability of each continuation of the prompt. The prompt
+// is evaluated once and its memory is shared by the continuations, which are
+// packed into batches of up to n_batch tokens. The last token of a
+// continuation is not evaluated since nothing depends on its logits. Only the
+// prompt is kept in the session.
+bool gptj_score(gptj_model_context *model_ctx, const char *prompt,
+                const char **continuations, const int n_continuations,
+                gptj_params params, const bool reset, float *logprobs) {
+  model_ctx->JoinWarmup();
+  if (reset) {
+    model_ctx->Reset();
+  }
+  if (params.n_threads <= 0) {
+    params.n_threads =
+        std::min(4, (int32_t)std::thread::hardware_concurrency());
+  }
+
+  const gptj_model &model = model_ctx->model;
+  const int n_ctx = model.hparams.n_ctx;
+  const int n_vocab = model.hparams.n_vocab;
+  const int n_batch = std::max(1, params.n_batch);
+
+  if (!gptj_eval_tokens(model_ctx, params,
+                        gpt_tokenize(model_ctx->vocab, prompt))) {
+    return false;
+  }
+  if (model_ctx->n_past == 0) {
+    fprintf(stderr, "%s: prompt is empty\n", __func__);
+    return false;
+  }
+
+  // cells before n_prefix hold the session and are visible to every token
+  const int n_prefix = model_ctx->n_past;
+  const int n_free = n_ctx - n_prefix;
+  const std::vector<float> prompt_logits = model_ctx->logits;
+
+  std::vector<std::vector<gpt_vocab::id>> tokens(n_continuations);
+  for (int i = 0; i < n_continuations; i++) {
+    tokens[i] = gpt_tokenize(model_ctx->vocab, continuations[i]);
+    if (tokens[i].size() > n_free + 1) {
+      fprintf(stderr, "%s: continuation %d is too long\n", __func__, i);
+      return false;
+    }
+    // the first token is predicted by the prompt
+    logprobs[i] = tokens[i].empty() ? 0.0f
+                                    : gpt_log_softmax(prompt_logits.data(),
+                                                      n_vocab, tokens[i][0]);
+  }
+
+  // the last token of each continuation is only predicted
+  std::vector<std::vector<gpt_vocab::id>> inputs(n_continuations);
+  for (int i = 0; i < n_continuations; i++) {
+    inputs[i].assign(tokens[i].begin(),
+                     tokens[i].end() - std::min<int>(1, tokens[i].size()));
+  }
+
+  // the logits of each token predict the next token of its continuation
+  return gptj_eval_sequences(
+      model, params.n_threads, n_batch, n_prefix, n_prefix, -1, inputs,
+      model_ctx->mem_per_token,
+      [&](const float *logits, const int i, const int pos) {
+        logprobs[i] += gpt_log_softmax(logits, n_vocab, tokens[i][pos + 1]);
+      });
+}
+
+// Evaluates the tokens after the session and writes the logits of each of them
+// to logits (n_tokens * n_vocab floats). The tokens are kept in the session.
+bool gptj_eval_logits(gptj_model_context *model_ctx, const int *tokens,
+                      const int n_tokens, gptj_params params, const bool reset,
+                      float *logits) {
+  model_ctx->JoinWarmup();
+  if (reset) {
+    model_ctx->Reset();
+  }
+  if (params.n_threads <= 0) {
+    params.n_threads =
+        std::min(4, (int32_t)std::thread::hardware_concurrency());
+  }
+  if (model_ctx->Size() + n_tokens > model_ctx->model.hparams.n_ctx) {
+    fprintf(stderr, "%s: too many tokens for the context\n", __func__);
+    return false;
+  }
+  return gptj_eval_tokens(model_ctx, params,
+                          std::vector<gpt_vocab::id>(tokens, tokens + n_tokens),
+                          logits);
+}
+
+// Warms up the model so that the first request is as fast as the next ones.
+// A prompt batch of params.n_batch tokens and a decoded token are evaluated
+// after the session without changing it, which sizes the eval buffer, and
+// the weights are paged in. In the background, this returns at once, the
+// other functions wait for the warmup to finish before using the model and
+// gptj_join_warmup() returns its result.
+bool gptj_warmup(gptj_model_context *model_ctx, gptj_params params,
+                 const bool background) {
+  model_ctx->JoinWarmup();
+  if (params.n_threads <= 0) {
+    params.n_threads =
+        std::min(4, (int32_t)std::thread::hardware_concurrency());
+  }
+  if (background) {
+    model_ctx->warmup = std::thread([model_ctx, params]() {
+      model_ctx->warmup_ok = gptj_warmup_model(model_ctx, params);
+    });
+    return true;
+  }
+  model_ctx->warmup_ok = gptj_warmup_model(model_ctx, params);
+  return model_ctx->warmup_ok;
+}
+
+// Waits for a warmup started in the background to finish and returns whether
+// the last warmup succeeded (true if there was none).
+bool gptj_join_warmup(gptj_model_context *model_ctx) {
+  return model_ctx->JoinWarmup();
+}
+
+// Writes the tokens of the text to tokens and returns their number. If there
+// are more than n_max_tokens tokens, nothing is written and the negative of
+// their number is returned.
+int gptj_tokenize(gptj_model_context *model_ctx, const char *text, int *tokens,
+                  const int n_max_tokens) {
+  const std::vector<gpt_vocab::id> ids = gpt_tokenize(model_ctx->vocab, text);
+  if (ids.size() > n_max_tokens) {
+    return -(int)ids.size();
+  }
+  std::copy(ids.begin(), ids.end(), tokens);
+  return ids.size();
+}
+
+int gptj_num_ctx(gptj_model_context *model_ctx) {
+  return model_ctx->model.hparams.n_ctx;
+}
+
+int gptj_num_vocab(gptj_model_context *model_ctx) {
+  return model_ctx->model.hparams.n_vocab;
+}
+
+int gptj_num_embd(gptj_model_context *model_ctx) {
+  return model_ctx->model.hparams.n_embd;
+}
+
 int gptj_num_tokens(gptj_model_context *model_ctx, const char *prompt) {
   return gpt_tokenize(model_ctx->vocab, prompt).size();
 }
 
+int gptj_num_past_tokens(gptj_model_context *model_ctx) {
+  return model_ctx->Size();
+}
+
+// Returns the statistics of the last call to gptj_generate() or, if session is
+// true, of all calls since the model was loaded or gptj_reset_stats() was
+// called.
+void gptj_get_stats(gptj_model_context *model_ctx, const bool session,
+                    gptj_stats *stats) {
+  *stats = model_ctx->stats.Get(session);
+}
+
+void gptj_reset_stats(gptj_model_context *model_ctx) {
+  model_ctx->stats.Clear();
+}
+
+// Enables or disables profiling of the evaluated graphs. The profile is kept
+// until gptj_reset_profile() is called.
+void gptj_set_profiling(gptj_model_context *model_ctx, const bool enabled) {
+  model_ctx->JoinWarmup();
+  model_ctx->model.profile = enabled ? &model_ctx->profile : nullptr;
+}
+
+void gptj_reset_profile(gptj_model_context *model_ctx) {
+  model_ctx->JoinWarmup();
+  model_ctx->profile.Clear();
+}
+
+// Writes the profile to a file.
+//
+//   - format: 0 = JSON totals of each op, 1 = Chrome trace of each node run
+//
+bool gptj_write_profile(gptj_model_context *model_ctx, const char *filename,
+                        const int format) {
+  if (format == 1) {
+    return model_ctx->profile.WriteTrace(filename);
+  }
+  return model_ctx->profile.WriteJson(filename);
+}
+
+// Drops the previous tokens after the first n_past tokens so that generation
+// can continue from an earlier point without evaluating the session again.
+bool gptj_truncate(gptj_model_context *model_ctx, const int n_past) {
+  model_ctx->JoinWarmup();
+  return model_ctx->Truncate(n_past);
+}
+
 #ifdef __cplusplus
 }
 #endif
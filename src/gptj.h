@@ -0,0 +1,154 @@
+#ifndef GPTJ_H
+#define GPTJ_H
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gptj_params {
+  int32_t seed = -1;  // RNG seed
+  int32_t n_threads = std::min(4, (int32_t)std::thread::hardware_concurrency());
+  int32_t n_predict = 200;  // new tokens to predict
+
+  // sampling parameters
+  int32_t top_k = 40;
+  float top_p = 0.9f;
+  float temp = 0.9f;
+  float repeat_penalty = 1.0f;  // 1.0 = disabled
+  // last n tokens to penalize (0 = disable penalty, -1 = context size)
+  int32_t repeat_last_n = 64;
+
+  int32_t n_batch = 8;  // batch size for prompt processing
+
+  // prompt lookup decoding
+  int32_t n_draft = 0;      // max tokens to draft per step (0 = disable)
+  int32_t draft_ngram = 3;  // n-gram size to match against previous tokens
+
+  // context shift
+  bool context_shift = true;  // discard old tokens when the context is full
+  int32_t n_keep = 0;         // tokens to keep from the start of the context
+
+  // grammar that the generated text must match, in GBNF without left recursion
+  // or repetitions of rules that can be empty (nullptr = disable)
+  const char *grammar = nullptr;
+};
+
+// Timings and counters of gptj_generate() for the last call or summed over the
+// session. Times are in milliseconds.
+struct gptj_stats {
+  int32_t n_calls;
+  double tokenize_ms;
+  int32_t n_prompt_tokens;  // tokens evaluated before sampling
+  double prompt_eval_ms;
+  int32_t n_decode_tokens;  // sampled tokens
+  double decode_ms;         // evaluating and sampling the sampled tokens
+  double decode_p50_ms;     // per-token decode latency percentiles, within 9%
+  double decode_p99_ms;
+  double sample_ms;
+  double callback_ms;
+  uint64_t peak_scratch_bytes;  // mem_per_token * largest batch
+  int32_t n_kv_used;            // tokens in the key + value memory
+  int32_t n_kv_size;
+};
+
+// Options of gptj_load_model_with_params().
+struct gptj_load_params {
+  // type to store the weight matrices in, such as "f16", "q4_0", "q4_1",
+  // "q5_0", "q5_1" or "q8_0" (nullptr = the type of each in the file). Weights
+  // stored as f16 or f32 in the file are converted while loading and the others
+  // keep their type.
+  const char *wtype = nullptr;
+  int32_t n_threads = 0;  // threads to read and convert with (0 = up to 8)
+  // map the weights of the layers from the file and page them in while
+  // evaluating, so that only a few layers use memory at a time, which is slower
+  // (needs the indexed format, not supported on Windows)
+  bool lazy_layers = false;
+  // back the weights and the key + value memory with huge pages of this size
+  // in MB, 2 or 1024, or with transparent huge pages if there are none free
+  // (0 = disable, Linux only)
+  int32_t huge_page_mb = 0;
+  // interleave the weights and the key + value memory over the NUMA nodes
+  // (Linux only)
+  bool numa_interleave = false;
+};
+
+struct gptj_model_context;
+
+const char *gptj_cpu_instructions();
+
+const char *gptj_build_instructions();
+
+gptj_model_context *gptj_load_model(const char *filename);
+
+gptj_model_context *gptj_load_model_with_params(const char *filename,
+                                                gptj_load_params params);
+
+void gptj_free_model(gptj_model_context *ctx);
+
+bool gptj_generate(gptj_model_context *model_ctx, const char *prompt,
+                   gptj_params params, bool reset,
+                   bool (*callback)(const char *token));
+
+bool gptj_beam_search(gptj_model_context *model_ctx, const char *prompt,
+                      gptj_params params, int n_beams, int n_best, bool reset,
+                      bool (*callback)(int index, const char *token));
+
+bool gptj_generate_n(gptj_model_context *model_ctx, const char *prompt,
+                     gptj_params params, int n, bool reset,
+                     bool (*callback)(int index, const char *token));
+
+bool gptj_embeddings(gptj_model_context *model_ctx, const char **texts,
+                     int n_texts, gptj_params params, int layer, int pooling,
+                     float *embeddings);
+
+bool gptj_score(gptj_model_context *model_ctx, const char *prompt,
+                const char **continuations, int n_continuations,
+                gptj_params params, bool reset, float *logprobs);
+
+bool gptj_eval_logits(gptj_model_context *model_ctx, const int *tokens,
+                      int n_tokens, gptj_params params, bool reset,
+                      float *logits);
+
+bool gptj_warmup(gptj_model_context *model_ctx, gptj_params params,
+                 bool background);
+
+bool gptj_join_warmup(gptj_model_context *model_ctx);
+
+const char *gptj_json_grammar();
+
+int gptj_tokenize(gptj_model_context *model_ctx, const char *text,
+                  int *tokens, int n_max_tokens);
+
+int gptj_num_ctx(gptj_model_context *model_ctx);
+
+int gptj_num_vocab(gptj_model_context *model_ctx);
+
+int gptj_num_embd(gptj_model_context *model_ctx);
+
+int gptj_num_tokens(gptj_model_context *model_ctx, const char *prompt);
+
+int gptj_num_past_tokens(gptj_model_context *model_ctx);
+
+bool gptj_truncate(gptj_model_context *model_ctx, int n_past);
+
+void gptj_get_stats(gptj_model_context *model_ctx, bool session,
+                    gptj_stats *stats);
+
+void gptj_reset_stats(gptj_model_context *model_ctx);
+
+void gptj_set_profiling(gptj_model_context *model_ctx, bool enabled);
+
+void gptj_reset_profile(gptj_model_context *model_ctx);
+
+bool gptj_write_profile(gptj_model_context *model_ctx, const char *filename,
+                        int format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // GPTJ_H
@@ -0,0 +1,203 @@
+// Computes the perplexity of a model on a text file.
+//
+//   gptj-perplexity -m model.bin -f text.txt [-c n_ctx] [-s stride]
+//                   [-t n_threads] [-b n_batch]
+//
+// The text is evaluated in windows of n_ctx tokens that start stride tokens
+// apart. Each token is scored once, in the first window that contains it, with
+// the tokens before it in that window as context.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gptj-internal.h"
+#include "gptj.h"
+
+namespace {
+
+double Seconds(const std::chrono::steady_clock::time_point &start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Tokenizes the text in pieces since the tokenizer is slow on long texts. The
+// text is only split after a newline between two characters that aren't
+// whitespace, where the tokenizer splits the words too, so that the tokens are
+// the same as those of the whole text.
+bool Tokenize(gptj_model_context *ctx, const std::string &text,
+              std::vector<int> &tokens) {
+  auto is_split = [&](const size_t i) {
+    return i > 0 && i + 1 < text.size() && !isspace((uint8_t)text[i - 1]) &&
+           !isspace((uint8_t)text[i + 1]);
+  };
+  size_t begin = 0;
+  while (begin < text.size()) {
+    size_t end = text.find('\n', begin);
+    while (end != std::string::npos && !is_split(end)) {
+      end = text.find('\n', end + 1);
+    }
+    end = end == std::string::npos ? text.size() : end + 1;
+    const std::string piece = text.substr(begin, end - begin);
+    std::vector<int> piece_tokens(piece.size() + 1);
+    const int n = gptj_tokenize(ctx, piece.c_str(), piece_tokens.data(),
+                                piece_tokens.size());
+    if (n < 0) {
+      return false;
+    }
+    tokens.insert(tokens.end(), piece_tokens.begin(),
+                  piece_tokens.begin() + n);
+    begin = end;
+  }
+  return true;
+}
+
+void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s -m model.bin -f text.txt [-c n_ctx] [-s stride] "
+          "[-t n_threads] [-b n_batch]\n",
+          argv0);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const auto t_start = std::chrono::steady_clock::now();
+
+  std::string model_path;
+  std::string text_path;
+  int n_ctx = 0;
+  int stride = 0;
+  gptj_params params;
+  params.n_batch = 64;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      Usage(argv[0]);
+      return 1;
+    }
+    const char *value = argv[++i];
+    if (arg == "-m") {
+      model_path = value;
+    } else if (arg == "-f") {
+      text_path = value;
+    } else if (arg == "-c") {
+      n_ctx = std::atoi(value);
+    } else if (arg == "-s") {
+      stride = std::atoi(value);
+    } else if (arg == "-t") {
+      params.n_threads = std::atoi(value);
+    } else if (arg == "-b") {
+      params.n_batch = std::atoi(value);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (model_path.empty() || text_path.empty()) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::ifstream fin(text_path, std::ios::binary);
+  if (!fin) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, text_path.c_str());
+    return 1;
+  }
+  const std::string text((std::istreambuf_iterator<char>(fin)),
+                         std::istreambuf_iterator<char>());
+
+  gptj_model_context *ctx = gptj_load_model(model_path.c_str());
+  if (ctx == nullptr) {
+    fprintf(stderr, "%s: failed to load model '%s'\n", __func__,
+            model_path.c_str());
+    return 1;
+  }
+
+  const int n_vocab = gptj_num_vocab(ctx);
+  if (n_ctx <= 0 || n_ctx > gptj_num_ctx(ctx)) {
+    n_ctx = gptj_num_ctx(ctx);
+  }
+  // a window of one token has no next token to score
+  if (n_ctx < 2) {
+    fprintf(stderr, "%s: n_ctx must be at least 2\n", __func__);
+    gptj_free_model(ctx);
+    return 1;
+  }
+  if (stride <= 0 || stride > n_ctx) {
+    stride = n_ctx / 2;
+  }
+
+  const auto t_tokenize = std::chrono::steady_clock::now();
+  std::vector<int> tokens;
+  if (!Tokenize(ctx, text, tokens)) {
+    fprintf(stderr, "%s: failed to tokenize '%s'\n", __func__,
+            text_path.c_str());
+    gptj_free_model(ctx);
+    return 1;
+  }
+  const double tokenize_s = Seconds(t_tokenize);
+  fprintf(stderr, "%s: %zu tokens, n_ctx = %d, stride = %d\n", __func__,
+          tokens.size(), n_ctx, stride);
+  if (tokens.size() < 2) {
+    fprintf(stderr, "%s: the text needs at least 2 tokens\n", __func__);
+    gptj_free_model(ctx);
+    return 1;
+  }
+
+  std::vector<float> logits;
+  double nll = 0.0;
+  int n_scored = 0;
+  int n_evaluated = 0;
+  double eval_s = 0.0;
+  int scored_end = 1;  // tokens before this one are scored or not scorable
+
+  for (int begin = 0; scored_end < (int)tokens.size(); begin += stride) {
+    const int end = std::min<int>(begin + n_ctx, tokens.size());
+    const int n = end - begin;
+    logits.resize((size_t)n * n_vocab);
+
+    const auto t_eval = std::chrono::steady_clock::now();
+    if (!gptj_eval_logits(ctx, tokens.data() + begin, n, params, true,
+                          logits.data())) {
+      fprintf(stderr, "%s: failed to evaluate tokens %d to %d\n", __func__,
+              begin, end);
+      gptj_free_model(ctx);
+      return 1;
+    }
+    eval_s += Seconds(t_eval);
+    n_evaluated += n;
+
+    // the logits of each token predict the next one
+    for (int i = std::max(scored_end, begin + 1); i < end; i++) {
+      nll -= gpt_log_softmax(
+          logits.data() + (size_t)(i - begin - 1) * n_vocab, n_vocab,
+          tokens[i]);
+      n_scored++;
+    }
+    scored_end = end;
+
+    printf("[%d/%zu] %.4f\n", end, tokens.size(), exp(nll / n_scored));
+    fflush(stdout);
+  }
+
+  printf("perplexity: %.4f\n", exp(nll / n_scored));
+  printf("tokens scored: %d\n", n_scored);
+  printf("tokenize time: %.2f s\n", tokenize_s);
+  printf("eval time: %.2f s (%d tokens, %.2f tokens/s)\n", eval_s, n_evaluated,
+         n_evaluated / eval_s);
+  printf("wall time: %.2f s\n", Seconds(t_start));
+
+  gptj_free_model(ctx);
+  return 0;
+}
@@ -0,0 +1,343 @@
+// Quantizes the weight matrices of a model and prints the error of each
+// tensor.
+//
+//   gptj-quantize -i model.bin -o model-q4_0.bin --type q4_0 [-t n_threads]
+//                 [--tensor-type pattern=type ...] [--indexed] [--align n]
+//
+// type is one of f16, q4_0, q4_1, q5_0, q5_1 or q8_0. The 2d weights stored as
+// f32 or f16 are converted and the other tensors, which are the norms and
+// biases, are stored as f32. The output is in the ggml format, or in the
+// indexed format with --indexed. See gptj-file.h.
+//
+// --tensor-type gives the type of the weights whose names contain pattern,
+// which can also be f32, and the first matching pattern is used. For example,
+// to keep the embeddings and the output layer in q8_0 and the attention in
+// q5_1:
+//
+//   --type q4_0 --tensor-type wte=q8_0 --tensor-type lm_head=q8_0
+//   --tensor-type attn=q5_1
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ggml/ggml.h"
+#include "gptj-file.h"
+
+namespace {
+
+// Error of the converted values, accumulated over rows.
+struct Error {
+  double sum_sq = 0.0;
+  double max = 0.0;
+  int64_t n = 0;
+
+  void Add(const Error &other) {
+    sum_sq += other.sum_sq;
+    max = std::max(max, other.max);
+    n += other.n;
+  }
+
+  double Rmse() const { return n > 0 ? std::sqrt(sum_sq / n) : 0.0; }
+};
+
+// Converts the rows of a tensor with n_threads threads that take the next
+// rows when they are done. src holds the tensor in src_type, which is f32 or
+// f16, and dst_type is f32, f16 or a quantized type. The values read back
+// from dst are compared with src.
+Error ConvertTensor(const gptj_file_tensor &tensor, const ggml_type src_type,
+                    const ggml_type dst_type, const char *src, char *dst,
+                    const int n_threads) {
+  const int64_t n_per_row = tensor.ne[0];
+  const int64_t n_rows = tensor.ne[1];
+  const int64_t rows_per_task = std::max<int64_t>(1, 65536 / n_per_row);
+  const size_t dst_row_size =
+      n_per_row * ggml_type_size(dst_type) / ggml_blck_size(dst_type);
+  const quantize_fns_t fns = ggml_internal_get_quantize_fn(dst_type);
+
+  std::atomic<int64_t> next(0);
+  std::mutex mutex;
+  Error error;
+  auto worker = [&]() {
+    std::vector<float> f32;
+    std::vector<float> out;
+    std::vector<int64_t> hist(1 << 4);
+    Error thread_error;
+    for (int64_t row = next.fetch_add(rows_per_task); row < n_rows;
+         row = next.fetch_add(rows_per_task)) {
+      const int64_t n_task_rows = std::min(rows_per_task, n_rows - row);
+      const int64_t n = n_task_rows * n_per_row;
+      const int64_t start = row * n_per_row;
+
+      f32.resize(n);
+      if (src_type == GGML_TYPE_F16) {
+        const ggml_fp16_t *src_f16 = (const ggml_fp16_t *)src + start;
+        for (int64_t i = 0; i < n; i++) {
+          f32[i] = ggml_fp16_to_fp32(src_f16[i]);
+        }
+      } else {
+        memcpy(f32.data(), (const float *)src + start, n * sizeof(float));
+      }
+
+      char *dst_rows = dst + row * dst_row_size;
+      out.resize(n);
+      if (dst_type == GGML_TYPE_F32) {
+        memcpy(dst_rows, f32.data(), n * sizeof(float));
+        memcpy(out.data(), f32.data(), n * sizeof(float));
+      } else if (dst_type == GGML_TYPE_F16) {
+        ggml_fp16_t *dst_f16 = (ggml_fp16_t *)dst_rows;
+        for (int64_t i = 0; i < n; i++) {
+          dst_f16[i] = ggml_fp32_to_fp16(f32[i]);
+          out[i] = ggml_fp16_to_fp32(dst_f16[i]);
+        }
+      } else {
+        ggml_quantize_chunk(dst_type, f32.data(), dst_rows, 0, n, hist.data());
+        for (int64_t r = 0; r < n_task_rows; r++) {
+          fns.dequantize_row_q(dst_rows + r * dst_row_size,
+                               out.data() + r * n_per_row, n_per_row);
+        }
+      }
+
+      for (int64_t i = 0; i < n; i++) {
+        const double diff = std::fabs((double)out[i] - f32[i]);
+        thread_error.sum_sq += diff * diff;
+        thread_error.max = std::max(thread_error.max, diff);
+      }
+      thread_error.n += n;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    error.Add(thread_error);
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 1; t < n_threads; t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &w : workers) {
+    w.join();
+  }
+  return error;
+}
+
+// The type of the weights whose names contain pattern.
+struct TypeRule {
+  std::string pattern;
+  ggml_type type;
+};
+
+bool Quantize(const std::string &fname_inp, const std::string &fname_out,
+              const ggml_type type, const std::vector<TypeRule> &rules,
+              const int n_threads, const bool indexed,
+              const uint32_t alignment) {
+  std::ifstream fin(fname_inp, std::ios::binary);
+  if (!fin) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname_inp.c_str());
+    return false;
+  }
+
+  gptj_file_model model;
+  if (!model.Read(fin)) {
+    fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname_inp.c_str());
+    return false;
+  }
+
+  // choose the type of each tensor
+  const std::vector<gptj_file_tensor> tensors_inp = model.tensors;
+  for (auto &tensor : model.tensors) {
+    ggml_type tensor_type = type;
+    for (const TypeRule &rule : rules) {
+      if (tensor.name.find(rule.pattern) != std::string::npos) {
+        tensor_type = rule.type;
+        break;
+      }
+    }
+
+    const bool convertible =
+        tensor.ttype == GGML_TYPE_F32 || tensor.ttype == GGML_TYPE_F16;
+    if (tensor.n_dims == 1 && convertible) {
+      tensor.ttype = GGML_TYPE_F32;
+    } else if (tensor.n_dims == 2 && convertible &&
+               tensor.ne[0] % ggml_blck_size(tensor_type) == 0) {
+      tensor.ttype = tensor_type;
+    } else if (tensor.ttype != tensor_type) {
+      fprintf(stderr, "%s: warning: keeping tensor '%s' as %s\n", __func__,
+              tensor.name.c_str(), ggml_type_name((ggml_type)tensor.ttype));
+    }
+    tensor.size = gptj_file_tensor_size(tensor.ttype, tensor.ne);
+  }
+
+  // the ftype is the type of most of the weight matrices that are written,
+  // which differs from type if some of them are kept in their type
+  std::map<int32_t, int> n_matrices;
+  for (const auto &tensor : model.tensors) {
+    if (tensor.n_dims == 2) {
+      n_matrices[tensor.ttype]++;
+    }
+  }
+  int32_t ftype_type = type;
+  int n_max = n_matrices.count(type) ? n_matrices.at(type) : 0;
+  for (const auto &[ttype, n] : n_matrices) {
+    if (n > n_max) {
+      ftype_type = ttype;
+      n_max = n;
+    }
+  }
+  const int32_t ftype = gptj_ftype_from_type((ggml_type)ftype_type);
+  if (ftype == GGML_FTYPE_UNKNOWN) {
+    fprintf(stderr, "%s: most weights are in %s, which has no ftype\n",
+            __func__, ggml_type_name((ggml_type)ftype_type));
+    return false;
+  }
+  model.hparams[6] = ftype;
+
+  std::ofstream fout(fname_out, std::ios::binary);
+  if (!fout) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname_out.c_str());
+    return false;
+  }
+  model.indexed = indexed;
+  model.alignment = alignment;
+  model.WriteHeader(fout);
+
+  printf("%-40s %-12s %-12s %10s %10s %12s %12s\n", "tensor", "shape", "type",
+         "MB in", "MB out", "rmse", "max error");
+  uint64_t total_inp = 0;
+  uint64_t total_out = 0;
+  Error total_error;
+  std::vector<char> src;
+  std::vector<char> dst;
+  for (int i = 0; i < (int)model.tensors.size(); i++) {
+    const gptj_file_tensor &inp = tensors_inp[i];
+    const gptj_file_tensor &out = model.tensors[i];
+
+    src.resize(inp.size);
+    fin.seekg(inp.offset);
+    fin.read(src.data(), src.size());
+    if (!fin) {
+      fprintf(stderr, "%s: failed to read tensor '%s'\n", __func__,
+              inp.name.c_str());
+      return false;
+    }
+
+    Error error;
+    const char *data = src.data();
+    if (out.ttype != inp.ttype) {
+      dst.resize(out.size);
+      error = ConvertTensor(inp, (ggml_type)inp.ttype, (ggml_type)out.ttype,
+                            src.data(), dst.data(), n_threads);
+      data = dst.data();
+    }
+    model.WriteTensorHeader(fout, i);
+    fout.write(data, out.size);
+
+    char shape[32];
+    snprintf(shape, sizeof(shape), "[%d, %d]", out.ne[0], out.ne[1]);
+    char types[32];
+    snprintf(types, sizeof(types), "%s->%s",
+             ggml_type_name((ggml_type)inp.ttype),
+             ggml_type_name((ggml_type)out.ttype));
+    printf("%-40s %-12s %-12s %10.2f %10.2f %12.6f %12.6f\n", out.name.c_str(),
+           shape, types, inp.size / 1024.0 / 1024.0, out.size / 1024.0 / 1024.0,
+           error.Rmse(), error.max);
+    fflush(stdout);
+
+    total_inp += inp.size;
+    total_out += out.size;
+    total_error.Add(error);
+  }
+
+  if (!fout) {
+    fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out.c_str());
+    return false;
+  }
+  printf("total size: %.2f MB -> %.2f MB\n", total_inp / 1024.0 / 1024.0,
+         total_out / 1024.0 / 1024.0);
+  printf("total rmse: %.6f, max error: %.6f\n", total_error.Rmse(),
+         total_error.max);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string fname_inp;
+  std::string fname_out;
+  std::string type_name;
+  std::vector<TypeRule> rules;
+  int n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  bool indexed = false;
+  uint32_t alignment = GPTJ_FILE_ALIGNMENT;
+
+  bool valid = true;
+  for (int i = 1; valid && i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--indexed") {
+      indexed = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      valid = false;
+      break;
+    }
+    const char *value = argv[++i];
+    if (arg == "-i") {
+      fname_inp = value;
+    } else if (arg == "-o") {
+      fname_out = value;
+    } else if (arg == "--type") {
+      type_name = value;
+    } else if (arg == "--tensor-type") {
+      const std::string rule = value;
+      const size_t eq = rule.find('=');
+      const ggml_type rule_type =
+          eq == std::string::npos ? GGML_TYPE_COUNT
+                                  : gptj_type_from_name(rule.substr(eq + 1));
+      if (eq == 0 || gptj_ftype_from_type(rule_type) == GGML_FTYPE_UNKNOWN) {
+        valid = false;
+      } else {
+        rules.push_back({rule.substr(0, eq), rule_type});
+      }
+    } else if (arg == "-t") {
+      n_threads = std::atoi(value);
+    } else if (arg == "--align") {
+      alignment = std::strtoul(value, nullptr, 10);
+    } else {
+      valid = false;
+    }
+  }
+  const ggml_type type = gptj_type_from_name(type_name);
+  // the alignment must be a power of 2
+  if (!valid || fname_inp.empty() || fname_out.empty() || n_threads < 1 ||
+      type == GGML_TYPE_F32 ||
+      gptj_ftype_from_type(type) == GGML_FTYPE_UNKNOWN || alignment == 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    fprintf(stderr,
+            "usage: %s -i model.bin -o model-q4_0.bin "
+            "--type f16|q4_0|q4_1|q5_0|q5_1|q8_0 [-t n_threads] "
+            "[--tensor-type pattern=type ...] [--indexed] [--align n]\n",
+            argv[0]);
+    return 1;
+  }
+
+  // initializes the tables used to convert f16
+  struct ggml_init_params params = {
+      .mem_size = 1024,
+      .mem_buffer = NULL,
+      .no_alloc = true,
+  };
+  struct ggml_context *ctx = ggml_init(params);
+  const bool ok = Quantize(fname_inp, fname_out, type, rules, n_threads,
+                           indexed, alignment);
+  ggml_free(ctx);
+  return ok ? 0 : 1;
+}
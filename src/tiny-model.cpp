@@ -0,0 +1,63 @@
+// Writes a small GPT-J model with random weights for testing and
+// benchmarking without a real checkpoint.
+//
+//   gptj-tiny-model -o model.bin [--n_vocab n] [--n_ctx n] [--n_embd n]
+//                   [--n_head n] [--n_layer n] [--n_rot n] [--ftype n]
+//                   [--seed n]
+//
+// ftype is a ggml_ftype: 0 = F32, 1 = F16, 2 = Q4_0, 3 = Q4_1, 7 = Q8_0,
+// 8 = Q5_0, 9 = Q5_1.
+
+#include <cstdlib>
+#include <string>
+
+#include "tiny-model.h"
+
+int main(int argc, char **argv) {
+  std::string fname;
+  gptj_tiny_model_params params;
+
+  for (int i = 1; i < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      fname.clear();
+      break;
+    }
+    const char *value = argv[i + 1];
+    if (arg == "-o") {
+      fname = value;
+    } else if (arg == "--n_vocab") {
+      params.n_vocab = std::atoi(value);
+    } else if (arg == "--n_ctx") {
+      params.n_ctx = std::atoi(value);
+    } else if (arg == "--n_embd") {
+      params.n_embd = std::atoi(value);
+    } else if (arg == "--n_head") {
+      params.n_head = std::atoi(value);
+    } else if (arg == "--n_layer") {
+      params.n_layer = std::atoi(value);
+    } else if (arg == "--n_rot") {
+      params.n_rot = std::atoi(value);
+    } else if (arg == "--ftype") {
+      params.ftype = std::atoi(value);
+    } else if (arg == "--seed") {
+      params.seed = std::strtoul(value, nullptr, 10);
+    } else {
+      fname.clear();
+      break;
+    }
+  }
+  if (fname.empty()) {
+    fprintf(stderr,
+            "usage: %s -o model.bin [--n_vocab n] [--n_ctx n] [--n_embd n] "
+            "[--n_head n] [--n_layer n] [--n_rot n] [--ftype n] [--seed n]\n",
+            argv[0]);
+    return 1;
+  }
+
+  if (!gptj_write_tiny_model(fname, params)) {
+    return 1;
+  }
+  fprintf(stderr, "%s: wrote '%s'\n", __func__, fname.c_str());
+  return 0;
+}
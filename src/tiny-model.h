@@ -0,0 +1,154 @@
+#ifndef GPTJ_TINY_MODEL_H
+#define GPTJ_TINY_MODEL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml/ggml.h"
+#include "gptj-file.h"
+
+struct gptj_tiny_model_params {
+  int32_t n_vocab = 4096;
+  int32_t n_ctx = 512;
+  int32_t n_embd = 256;
+  int32_t n_head = 4;
+  int32_t n_layer = 4;
+  int32_t n_rot = 32;
+  int32_t ftype = GGML_FTYPE_MOSTLY_F16;
+  uint32_t seed = 1234;
+};
+
+// Writes a GPT-J model with random weights in the format read by
+// gptj_model_load(). The same parameters always give the same file. The vocab
+// has every byte and a few English words so that any text can be tokenized.
+inline bool gptj_write_tiny_model(const std::string &fname,
+                                  const gptj_tiny_model_params &params) {
+  const ggml_type wtype = ggml_ftype_to_ggml_type((ggml_ftype)params.ftype);
+  if (wtype == GGML_TYPE_COUNT) {
+    fprintf(stderr, "%s: invalid ftype %d\n", __func__, params.ftype);
+    return false;
+  }
+  if (params.n_vocab < 256 || params.n_layer < 1 || params.n_head < 1 ||
+      params.n_embd % params.n_head != 0 ||
+      params.n_embd % ggml_blck_size(wtype) != 0 ||
+      params.n_rot > params.n_embd / params.n_head || params.n_rot % 2 != 0) {
+    fprintf(stderr, "%s: invalid hparams\n", __func__);
+    return false;
+  }
+
+  std::ofstream fout(fname, std::ios::binary);
+  if (!fout) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+    return false;
+  }
+
+  auto write_i32 = [&](const int32_t value) {
+    fout.write((const char *)&value, sizeof(value));
+  };
+
+  // hparams
+  write_i32(GPTJ_FILE_MAGIC);
+  write_i32(params.n_vocab);
+  write_i32(params.n_ctx);
+  write_i32(params.n_embd);
+  write_i32(params.n_head);
+  write_i32(params.n_layer);
+  write_i32(params.n_rot);
+  write_i32(params.ftype);
+
+  // vocab
+  std::vector<std::string> tokens;
+  for (int c = 0; c < 256; c++) {
+    tokens.push_back(std::string(1, (char)c));
+  }
+  for (const char *word :
+       {"the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "was", "with", "be", "on", "not", "he", "this", "are", "or", "his"}) {
+    tokens.push_back(word);
+    tokens.push_back(std::string(" ") + word);
+  }
+  while (tokens.size() < params.n_vocab) {
+    tokens.push_back("<" + std::to_string(tokens.size()) + ">");
+  }
+  write_i32(params.n_vocab);
+  for (int i = 0; i < params.n_vocab; i++) {
+    write_i32(tokens[i].size());
+    fout.write(tokens[i].data(), tokens[i].size());
+  }
+
+  // weights
+  std::mt19937 rng(params.seed);
+  std::normal_distribution<float> dist(0.0f, 0.02f);
+  std::vector<float> data;
+  std::vector<char> buf;
+  std::vector<int64_t> hist(1 << 4);
+
+  // 2d weights are stored in the model type and 1d tensors in F32, which are
+  // filled with value instead of random numbers
+  auto write_tensor = [&](const std::string &name, const int ne0,
+                          const int ne1, const float value) {
+    const int n_dims = ne1 == 1 ? 1 : 2;
+    const ggml_type ttype = n_dims == 1 ? GGML_TYPE_F32 : wtype;
+    write_i32(n_dims);
+    write_i32(name.size());
+    write_i32(ttype);
+    write_i32(ne0);
+    if (n_dims == 2) {
+      write_i32(ne1);
+    }
+    fout.write(name.data(), name.size());
+
+    const int n = ne0 * ne1;
+    data.resize(n);
+    for (float &x : data) {
+      x = n_dims == 1 ? value : dist(rng);
+    }
+
+    buf.resize(n * ggml_type_size(ttype) / ggml_blck_size(ttype));
+    if (ttype == GGML_TYPE_F32) {
+      memcpy(buf.data(), data.data(), buf.size());
+    } else if (ttype == GGML_TYPE_F16) {
+      ggml_fp16_t *dst = (ggml_fp16_t *)buf.data();
+      for (int i = 0; i < n; i++) {
+        dst[i] = ggml_fp32_to_fp16(data[i]);
+      }
+    } else {
+      ggml_quantize_chunk(ttype, data.data(), buf.data(), 0, n, hist.data());
+    }
+    fout.write(buf.data(), buf.size());
+  };
+
+  const int n_embd = params.n_embd;
+  const int n_vocab = params.n_vocab;
+  write_tensor("transformer.wte.weight", n_embd, n_vocab, 0.0f);
+  for (int i = 0; i < params.n_layer; i++) {
+    const std::string prefix = "transformer.h." + std::to_string(i) + ".";
+    write_tensor(prefix + "ln_1.weight", n_embd, 1, 1.0f);
+    write_tensor(prefix + "ln_1.bias", n_embd, 1, 0.0f);
+    write_tensor(prefix + "attn.q_proj.weight", n_embd, n_embd, 0.0f);
+    write_tensor(prefix + "attn.k_proj.weight", n_embd, n_embd, 0.0f);
+    write_tensor(prefix + "attn.v_proj.weight", n_embd, n_embd, 0.0f);
+    write_tensor(prefix + "attn.out_proj.weight", n_embd, n_embd, 0.0f);
+    write_tensor(prefix + "mlp.fc_in.weight", n_embd, 4 * n_embd, 0.0f);
+    write_tensor(prefix + "mlp.fc_in.bias", 4 * n_embd, 1, 0.0f);
+    write_tensor(prefix + "mlp.fc_out.weight", 4 * n_embd, n_embd, 0.0f);
+    write_tensor(prefix + "mlp.fc_out.bias", n_embd, 1, 0.0f);
+  }
+  write_tensor("transformer.ln_f.weight", n_embd, 1, 1.0f);
+  write_tensor("transformer.ln_f.bias", n_embd, 1, 0.0f);
+  write_tensor("lm_head.weight", n_embd, n_vocab, 0.0f);
+  write_tensor("lm_head.bias", n_vocab, 1, 0.0f);
+
+  if (!fout.good()) {
+    fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif  // GPTJ_TINY_MODEL_H
@@ -0,0 +1,168 @@
+// Checks the ways of loading a model against each other on a small model with
+// random weights, which give the same logits:
+//
+//   - the ggml file, and an indexed copy of it with lazily loaded layers
+//   - the f16 file converted to q8_0 while loading, and a copy of the file
+//     quantized to q8_0 beforehand as gptj-quantize does
+//
+// The embeddings and the output layer are larger than the parts that tensors
+// are read and converted in, so the conversion of a tensor read in several
+// parts is covered.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ggml/ggml.h"
+#include "gptj-file.h"
+#include "gptj.h"
+#include "tiny-model.h"
+
+namespace {
+
+// Writes a copy of the model with the weight matrices quantized to type,
+// each tensor at once.
+bool WriteQuantized(const std::string &fname_inp, const std::string &fname_out,
+                    const ggml_type type) {
+  std::ifstream fin(fname_inp, std::ios::binary);
+  gptj_file_model model;
+  if (!model.Read(fin)) {
+    return false;
+  }
+  const std::vector<gptj_file_tensor> tensors_inp = model.tensors;
+  for (auto &tensor : model.tensors) {
+    if (tensor.n_dims == 2) {
+      tensor.ttype = type;
+      tensor.size = gptj_file_tensor_size(tensor.ttype, tensor.ne);
+    }
+  }
+  model.hparams[6] = gptj_ftype_from_type(type);
+
+  std::ofstream fout(fname_out, std::ios::binary);
+  model.WriteHeader(fout);
+  std::vector<char> src;
+  std::vector<float> f32;
+  std::vector<char> dst;
+  std::vector<int64_t> hist(1 << 4);
+  for (int i = 0; i < (int)model.tensors.size(); i++) {
+    const gptj_file_tensor &inp = tensors_inp[i];
+    const gptj_file_tensor &out = model.tensors[i];
+    src.resize(inp.size);
+    fin.seekg(inp.offset);
+    fin.read(src.data(), src.size());
+
+    const char *data = src.data();
+    if (out.ttype != inp.ttype) {
+      const int64_t n = (int64_t)inp.ne[0] * inp.ne[1];
+      f32.resize(n);
+      const ggml_fp16_t *src_f16 = (const ggml_fp16_t *)src.data();
+      for (int64_t j = 0; j < n; j++) {
+        f32[j] = ggml_fp16_to_fp32(src_f16[j]);
+      }
+      dst.resize(out.size);
+      ggml_quantize_chunk(type, f32.data(), dst.data(), 0, n, hist.data());
+      data = dst.data();
+    }
+    model.WriteTensorHeader(fout, i);
+    fout.write(data, out.size);
+  }
+  return fin.good() && fout.good();
+}
+
+// Writes an indexed copy of the model.
+bool WriteIndexed(const std::string &fname_inp, const std::string &fname_out) {
+  std::ifstream fin(fname_inp, std::ios::binary);
+  std::ofstream fout(fname_out, std::ios::binary);
+  gptj_file_model model;
+  return model.Read(fin) &&
+         model.WriteIndexed(fin, fout, GPTJ_FILE_ALIGNMENT);
+}
+
+// Returns the logits of every token, or nothing if the model fails to load.
+std::vector<float> EvalLogits(const std::string &fname,
+                              const gptj_load_params &load_params,
+                              const std::vector<int> &tokens) {
+  gptj_model_context *ctx =
+      gptj_load_model_with_params(fname.c_str(), load_params);
+  if (ctx == nullptr) {
+    return {};
+  }
+  std::vector<float> logits((size_t)tokens.size() * gptj_num_vocab(ctx));
+  gptj_params params;
+  params.n_batch = tokens.size();
+  if (!gptj_eval_logits(ctx, tokens.data(), tokens.size(), params, true,
+                        logits.data())) {
+    logits.clear();
+  }
+  gptj_free_model(ctx);
+  return logits;
+}
+
+// Returns whether the logits are the same up to rounding, and prints the
+// largest difference.
+bool Compare(const char *name, const std::vector<float> &expected,
+             const std::vector<float> &actual) {
+  if (expected.empty() || expected.size() != actual.size()) {
+    fprintf(stderr, "%s: failed to evaluate the model\n", name);
+    return false;
+  }
+  double max_diff = 0.0;
+  for (size_t i = 0; i < expected.size(); i++) {
+    max_diff = std::max(max_diff, (double)std::fabs(expected[i] - actual[i]));
+  }
+  const bool ok = max_diff <= 1e-4;
+  fprintf(stderr, "%s: %s, max difference %g\n", name, ok ? "ok" : "FAILED",
+          max_diff);
+  return ok;
+}
+
+}  // namespace
+
+int main() {
+  const std::filesystem::path dir = std::filesystem::temp_directory_path();
+  const std::string model_path = (dir / "gptj-test-model.bin").string();
+  const std::string indexed_path =
+      (dir / "gptj-test-model-indexed.bin").string();
+  const std::string q8_0_path = (dir / "gptj-test-model-q8_0.bin").string();
+
+  // n_vocab * n_embd f16 values are more than the 32MB parts
+  gptj_tiny_model_params params;
+  params.n_vocab = 50400;
+  params.n_ctx = 64;
+  params.n_embd = 384;
+  params.n_head = 4;
+  params.n_layer = 2;
+  params.ftype = GGML_FTYPE_MOSTLY_F16;
+
+  bool ok = gptj_write_tiny_model(model_path, params) &&
+            WriteIndexed(model_path, indexed_path) &&
+            WriteQuantized(model_path, q8_0_path, GGML_TYPE_Q8_0);
+  if (ok) {
+    const std::vector<int> tokens = {464, 2068, 7586, 21831,
+                                     18045, 625, 262, 16931};
+
+    const gptj_load_params plain;
+    gptj_load_params lazy;
+    lazy.lazy_layers = true;
+    gptj_load_params convert;
+    convert.wtype = "q8_0";
+
+    const std::vector<float> expected = EvalLogits(model_path, plain, tokens);
+    // on Windows all the layers are loaded instead
+    ok = Compare("lazy", expected, EvalLogits(indexed_path, lazy, tokens));
+    ok = Compare("convert", EvalLogits(q8_0_path, plain, tokens),
+                 EvalLogits(model_path, convert, tokens)) &&
+         ok;
+  } else {
+    fprintf(stderr, "failed to write the models\n");
+  }
+
+  std::filesystem::remove(model_path);
+  std::filesystem::remove(indexed_path);
+  std::filesystem::remove(q8_0_path);
+  return ok ? 0 : 1;
+}